@@ -15,4 +15,93 @@ int register_cli(void);
 
 extern char *incoming_context;
 extern int monitor_resolve_numbers;
+
+// call timeouts in milliseconds, 0 disables
+extern int vomp_setup_timeout;
+extern int vomp_ring_timeout;
+extern int vomp_media_timeout;
+// how long to wait for servald to confirm surviving sessions after reconnecting
+extern int vomp_resync_timeout;
+
+// with max_calls set, sessions are preallocated at load time and calls beyond that are refused
+// embedded builds can set a default with make MAX_CALLS=n
+#ifndef VOMP_DEFAULT_MAX_CALLS
+#define VOMP_DEFAULT_MAX_CALLS 0
+#endif
+extern int vomp_max_calls;
+
+// admission control, new calls are refused with congestion once a limit is reached, 0 for no limit
+extern int vomp_max_sessions; // concurrent sessions
+extern int vomp_max_peer_calls; // concurrent sessions with one sid
+extern int vomp_max_bandwidth; // estimated kbps of audio on each servald instance
+extern int vomp_max_queue; // bytes waiting to be read by servald
+
+// earlier frames repeated in each audio packet, when the far end supports it
+#define VOMP_REDUNDANCY_MAX 2
+extern int vomp_redundancy;
+// percentage of incoming audio to throw away, for testing loss recovery
+extern int vomp_simulate_loss;
+// ms of audio in each packet we send, 20, 40 or 60, or 0 to choose by codec and jitter
+#define VOMP_FRAME_MS 20
+extern int vomp_ptime;
+
+// each servald instance has its own monitor connection, outgoing calls are balanced between them
+#define VOMP_MAX_INSTANCES 16
+int vomp_add_instance(const char *name, const char *path, int weight);
+// the serval client libraries only find servald through the process wide instance path,
+// hold this around every call that opens a connection or sends or receives over MDP
+void vomp_path_lock(const char *path);
+void vomp_path_unlock(void);
+
+// DNA lookups over MDP with a cache of results, see dna_lookup.c
+// in milliseconds
+extern int dna_lookup_timeout;
+extern int dna_cache_timeout;
+// dialled prefixes shorter than this aren't looked up speculatively
+extern int dna_prefetch_min_digits;
+int dna_lookup_start(const char *instancepath);
+void dna_lookup_stop(void);
+int dna_lookup(const char *did, char *dest, int len);
+void dna_prefetch(const void *owner, const char *context, const char *digits);
+void dna_prefetch_done(const void *owner);
+// FastAGI lookup service, see dna_agi.c
+int dna_agi_start(const char *address);
+void dna_agi_stop(void);
+
+// mesh peer reachability, see vomp_peers.c
+// how long a peer is reported unavailable after repeated calls fail to reach it, in milliseconds
+extern int vomp_peer_holddown;
+// the most peers we'll keep track of, 0 for no limit
+extern int vomp_max_peers;
+int vomp_peers_init(void);
+void vomp_peers_destroy(void);
+void vomp_peer_reachable(const char *sid, int instance, int reachable);
+void vomp_peer_instance_lost(int instance);
+void vomp_peer_call_result(const char *sid, int reached);
+void vomp_peer_call_count(const char *sid, int delta);
+int vomp_peer_state(const char *sid);
+int vomp_peer_calls(const char *sid);
+int vomp_peer_reachable_via(const char *sid, int instance);
+void vomp_peers_usage(int *count, int *size);
+
+// timing wheel, see vomp_timer.c
+#define VOMP_TIMER_TICK_MS 50
+
+struct vomp_timer {
+	struct vomp_timer *next, *prev;
+	unsigned long long rounds;
+	unsigned slot;
+	int armed; // in the wheel, or expired and waiting for its callback
+	int expiring; // on the expired list rather than in a slot
+	unsigned generation; // counts every set and cancel
+	unsigned fired; // the generation that last expired
+	void (*callback)(struct vomp_timer *timer);
+	void *context;
+};
+
+int vomp_timer_start(void);
+void vomp_timer_stop(void);
+int vomp_timer_set(struct vomp_timer *timer, int delay_ms);
+int vomp_timer_cancel(struct vomp_timer *timer);
+int vomp_timer_current(struct vomp_timer *timer);
 #endif
@@ -33,6 +33,7 @@
 #include "asterisk/utils.h"
 #include "asterisk/app.h"
 #include "asterisk/cli.h"
+#include "asterisk/framehook.h"
 #include "app.h"
 #include "log.h"
 #include "strbuf.h"
@@ -40,6 +41,7 @@
 //#include "conf.h"
 
 static int	servaldna_exec(struct ast_channel *chan, const char *data);
+static int	servaldna_prefetch_exec(struct ast_channel *chan, const char *data);
 static char 	*servaldna_lookup(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
 static int	unload_module(void);
 static int	load_module(void);
@@ -49,6 +51,8 @@ static void	asterisk_log(int level, struct strbuf *buf);
 static char *instancepath = NULL;
 static char config_file[] = "servaldna.conf";
 static char app[] = "ServalDNA";
+static char prefetch_app[] = "ServalDNAPrefetch";
+static char *fastagi = NULL;
 static struct ast_cli_entry cli_servaldna[] = {
     AST_CLI_DEFINE(servaldna_lookup,	"Lookup a number via Serval DNA"),
 };
@@ -65,6 +69,36 @@ static struct ast_cli_entry cli_servaldna[] = {
 		<para>Lookup <replaceable>number</replaceable> via Serval DNA to try and find a URL.
 		</description>
 	</application>
+	<application name="ServalDNAPrefetch" language="en_US">
+		<synopsis>
+			Start Serval DNA lookups while a number is being dialled
+		</synopsis>
+		<syntax>
+			<parameter name="context">
+				<para>The context the number will be dialled in, defaults to the current context.</para>
+			</parameter>
+		</syntax>
+		<description>
+		<para>Watches the digits dialled on this channel, and once they form a number that
+		<replaceable>context</replaceable> would accept, and no longer number could match or the
+		caller pauses, starts looking that number up in the background. By the time dialling is
+		complete the answer is usually already cached, so ServalDNA returns without waiting for
+		the mesh.</para>
+		</description>
+	</application>
+	<function name="SERVALDNA" language="en_US">
+		<synopsis>
+			Lookup a number via Serval DNA
+		</synopsis>
+		<syntax>
+			<parameter name="number" required="true" />
+		</syntax>
+		<description>
+		<para>Returns a dial string for <replaceable>number</replaceable>, such as
+		VOMP/<replaceable>sid</replaceable>, or nothing if it couldn't be found.
+		Sets SERVALDNA_STATUS to RESOLVED, UNRESOLVED or FAILURE.</para>
+		</description>
+	</function>
  ***/
 static int
 servaldna_exec(struct ast_channel *chan, const char *data) {
@@ -87,17 +121,101 @@ servaldna_exec(struct ast_channel *chan, const char *data) {
 
     servaldna_query(arglist.did, &reply);
 
-    ast_log(LOG_WARNING, "Lookup returned \'%s\'\n", reply);
-	
     if (reply == NULL)
 	return -1;
     
+    ast_log(LOG_WARNING, "Lookup returned \'%s\'\n", reply);
+	
     pbx_builtin_setvar_helper(chan, "SDNA_DEST", reply);
 
     free(reply);
     return 0;
 }
 
+struct prefetch_state {
+    char context[AST_MAX_CONTEXT];
+    char digits[AST_MAX_EXTENSION];
+    int len;
+};
+
+static struct ast_frame *
+prefetch_event(struct ast_channel *chan, struct ast_frame *frame, enum ast_framehook_event event, void *data) {
+    struct prefetch_state *state = data;
+
+    if (!frame || event != AST_FRAMEHOOK_EVENT_READ || frame->frametype != AST_FRAME_DTMF_END)
+	return frame;
+    // once the call is connected, any more digits are for the far end
+    if (ast_bridged_channel(chan) || state->len >= sizeof(state->digits) - 1)
+	return frame;
+
+    state->digits[state->len++] = frame->subclass.integer;
+    state->digits[state->len] = 0;
+    dna_prefetch(state, state->context, state->digits);
+    return frame;
+}
+
+static void
+prefetch_destroy(void *data) {
+    dna_prefetch_done(data);
+    ast_free(data);
+}
+
+static int
+servaldna_prefetch_exec(struct ast_channel *chan, const char *data) {
+    struct prefetch_state *state;
+    struct ast_framehook_interface interface = {
+	.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+	.event_cb = prefetch_event,
+	.destroy_cb = prefetch_destroy,
+    };
+
+    if ((state = ast_calloc(1, sizeof(*state))) == NULL)
+	return -1;
+
+    ast_channel_lock(chan);
+    ast_copy_string(state->context, ast_strlen_zero(data) ? ast_channel_context(chan) : data, sizeof(state->context));
+    interface.data = state;
+    if (ast_framehook_attach(chan, &interface) < 0) {
+	ast_channel_unlock(chan);
+	ast_log(LOG_WARNING, "Unable to watch digits dialled on %s\n", ast_channel_name(chan));
+	ast_free(state);
+	return 0;
+    }
+    ast_channel_unlock(chan);
+    return 0;
+}
+
+static int
+servaldna_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len) {
+    const char *status;
+
+    if (ast_strlen_zero(data)) {
+	ast_log(LOG_WARNING, "SERVALDNA requires a number to lookup\n");
+	return -1;
+    }
+
+    switch (dna_lookup(data, buf, len)) {
+	case 1:
+	    status = "RESOLVED";
+	    break;
+	case 0:
+	    status = "UNRESOLVED";
+	    break;
+	default:
+	    status = "FAILURE";
+    }
+    if (chan)
+	pbx_builtin_setvar_helper(chan, "SERVALDNA_STATUS", status);
+    if (strcmp(status, "RESOLVED"))
+	buf[0] = '\0';
+    return 0;
+}
+
+static struct ast_custom_function servaldna_function = {
+    .name = "SERVALDNA",
+    .read = servaldna_read,
+};
+
 static char *
 servaldna_lookup(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
     char 	*reply;
@@ -126,6 +244,7 @@ servaldna_lookup(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a) {
     }
 	
     ast_cli(a->fd, "Lookup returned \'%s\'\n", reply);
+    free(reply);
 
     return CLI_SUCCESS;
 }
@@ -137,9 +256,16 @@ unregister_cli(void) {
     if (instancepath != NULL)
 	free(instancepath);
     instancepath = NULL;
+    if (fastagi != NULL)
+	free(fastagi);
+    fastagi = NULL;
     
     ast_cli_unregister_multiple(cli_servaldna, ARRAY_LEN(cli_servaldna));
     ast_unregister_application(app);
+    ast_unregister_application(prefetch_app);
+    ast_custom_function_unregister(&servaldna_function);
+    dna_agi_stop();
+    dna_lookup_stop();
 
     return 0;
 }
@@ -168,15 +294,95 @@ register_cli(void) {
     }
     
     monitor_resolve_numbers = ast_true(ast_variable_retrieve(cfg, "general", "resolve_numbers"));
+
+    // call timeouts are configured in seconds
+    if ((tmp = ast_variable_retrieve(cfg, "general", "setup_timeout")) != NULL)
+	vomp_setup_timeout = atoi(tmp) * 1000;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "ring_timeout")) != NULL)
+	vomp_ring_timeout = atoi(tmp) * 1000;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "media_timeout")) != NULL)
+	vomp_media_timeout = atoi(tmp) * 1000;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "resync_timeout")) != NULL)
+	vomp_resync_timeout = atoi(tmp) * 1000;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "peer_holddown")) != NULL)
+	vomp_peer_holddown = atoi(tmp) * 1000;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "max_calls")) != NULL)
+	vomp_max_calls = atoi(tmp);
+    if ((tmp = ast_variable_retrieve(cfg, "general", "max_peers")) != NULL)
+	vomp_max_peers = atoi(tmp);
+    
+    // admission control
+    if ((tmp = ast_variable_retrieve(cfg, "general", "max_sessions")) != NULL)
+	vomp_max_sessions = atoi(tmp);
+    if ((tmp = ast_variable_retrieve(cfg, "general", "max_peer_calls")) != NULL)
+	vomp_max_peer_calls = atoi(tmp);
+    if ((tmp = ast_variable_retrieve(cfg, "general", "max_bandwidth")) != NULL)
+	vomp_max_bandwidth = atoi(tmp);
+    if ((tmp = ast_variable_retrieve(cfg, "general", "max_queue")) != NULL)
+	vomp_max_queue = atoi(tmp);
+    
+    if ((tmp = ast_variable_retrieve(cfg, "general", "packetization")) != NULL) {
+	if (!strcasecmp(tmp, "auto"))
+	    vomp_ptime = 0;
+	else
+	    vomp_ptime = atoi(tmp) <= 20 ? 20 : atoi(tmp) <= 40 ? 40 : 60;
+    }
+    
+    // loss recovery
+    if ((tmp = ast_variable_retrieve(cfg, "general", "redundancy")) != NULL)
+	vomp_redundancy = ast_true(tmp) ? 1 : atoi(tmp);
+    if (vomp_redundancy > VOMP_REDUNDANCY_MAX)
+	vomp_redundancy = VOMP_REDUNDANCY_MAX;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "simulate_loss")) != NULL)
+	vomp_simulate_loss = atoi(tmp);
+    
+    // dna lookups
+    if ((tmp = ast_variable_retrieve(cfg, "general", "lookup_timeout")) != NULL)
+	dna_lookup_timeout = atoi(tmp) * 1000;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "lookup_cache")) != NULL)
+	dna_cache_timeout = atoi(tmp) * 1000;
+    if ((tmp = ast_variable_retrieve(cfg, "general", "prefetch_min_digits")) != NULL)
+	dna_prefetch_min_digits = atoi(tmp);
+    if ((tmp = ast_variable_retrieve(cfg, "general", "fastagi")) != NULL)
+	fastagi = strdup(tmp);
     
-    setenv("SERVALINSTANCE_PATH", instancepath,1);
     ast_log(LOG_WARNING, "Using instance path %s\n", instancepath);
     
+    if (dna_lookup_start(instancepath))
+	ast_log(LOG_WARNING, "Unable to start DNA lookups\n");
+    else if (fastagi != NULL && dna_agi_start(fastagi))
+	ast_log(LOG_WARNING, "Unable to start FastAGI lookups\n");
+    
+    // the general instance carries calls, along with any other category that names an instancepath
+    tmp = ast_variable_retrieve(cfg, "general", "weight");
+    vomp_add_instance("default", instancepath, tmp ? atoi(tmp) : 1);
+    
+    const char *cat = NULL;
+    while ((cat = ast_category_browse(cfg, cat)) != NULL) {
+	const char *path;
+	if (!strcasecmp(cat, "general"))
+	    continue;
+	if ((path = ast_variable_retrieve(cfg, cat, "instancepath")) == NULL)
+	    continue;
+	tmp = ast_variable_retrieve(cfg, cat, "weight");
+	vomp_add_instance(cat, path, tmp ? atoi(tmp) : 1);
+    }
+    
     if (ast_register_application_xml(app, servaldna_exec)) {
 	ast_log(LOG_WARNING, "Unable to register function\n");
 	goto error;
     }
     
+    if (ast_register_application_xml(prefetch_app, servaldna_prefetch_exec)) {
+	ast_log(LOG_WARNING, "Unable to register function\n");
+	goto error;
+    }
+    
+    if (ast_custom_function_register(&servaldna_function)) {
+	ast_log(LOG_WARNING, "Unable to register function\n");
+	goto error;
+    }
+    
     if (ast_cli_register_multiple(cli_servaldna, ARRAY_LEN(cli_servaldna))) {
 	ast_log(LOG_WARNING, "Unable to register CLI functions\n");
 	goto error;
@@ -223,13 +429,18 @@ load_module(void){
 
 static int 
 unload_module(void) {
+    vomp_unregister_channel();
     unregister_cli();
     return 0;
 }
 
 static void
 servaldna_query(const char *did, char **reply) {
-    *reply = strdup("TODO use mdp to run a dna lookup");
+    char dest[256];
+
+    *reply = NULL;
+    if (dna_lookup(did, dest, sizeof(dest)) == 1)
+	*reply = strdup(dest);
 }
 
 AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_LOAD_ORDER, "Lookup numbers via Serval DNA",
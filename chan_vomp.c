@@ -18,6 +18,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include "asterisk.h"
 #include "asterisk/lock.h"
@@ -45,6 +49,8 @@
 #include "monitor-client.h"
 #include "constants.h"
 
+struct vomp_instance;
+
 static struct ast_channel  *vomp_request(const char *type, struct ast_format_cap *cap, 
     const struct ast_channel *requestor, const char *addr, int *cause);
 static int vomp_call(struct ast_channel *ast, const char *dest, int timeout);
@@ -54,14 +60,14 @@ static struct ast_frame *vomp_read(struct ast_channel *ast);
 static int vomp_write(struct ast_channel *ast, struct ast_frame *frame);
 static int vomp_indicate(struct ast_channel *ast, int ind, const void *data, size_t datalen);
 static int vomp_fixup(struct ast_channel *oldchan, struct ast_channel *newchan);
-static struct vomp_channel *get_channel(char *token);
+static int vomp_devicestate(const char *data);
+static struct vomp_channel *get_channel(struct vomp_instance *instance, char *token);
 
-static void send_hangup(int session_id);
+static void send_hangup(struct vomp_instance *instance, int session_id);
 static void send_ringing(struct vomp_channel *vomp_state);
 static void send_pickup(struct vomp_channel *vomp_state);
-static void send_call(const char *sid, const char *caller_id, const char *remote_ext);
+static void send_call(struct vomp_instance *instance, const char *sid, const char *caller_id, const char *remote_ext);
 static void send_audio(struct vomp_channel *vomp_state, unsigned char *buffer, int len, int codec, int time, int sequence);
-static void send_lookup_response(const char *sid, const char *port, const char *ext, const char *name);
 
 static int remote_dialing(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
 static int remote_call(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
@@ -71,14 +77,42 @@ static int remote_audio(char *cmd, int argc, char **argv, unsigned char *data, i
 static int remote_codecs(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
 static int remote_ringing(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
 static int remote_noop(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
+static int remote_callstatus(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
+static int remote_keepalive(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
 static int remote_lookup(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
+static int remote_newpeer(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
+static int remote_oldpeer(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context);
 
 char *incoming_context = "servald-in";
 
 //AST_MUTEX_DEFINE_STATIC(vomplock); 
-int monitor_client_fd=-1;
 int monitor_resolve_numbers;
 
+int vomp_setup_timeout = 15000;
+int vomp_ring_timeout = 60000;
+int vomp_media_timeout = 10000;
+int vomp_resync_timeout = 3000;
+int vomp_max_calls = VOMP_DEFAULT_MAX_CALLS;
+int vomp_max_sessions;
+int vomp_max_peer_calls;
+int vomp_max_bandwidth;
+int vomp_max_queue;
+int vomp_redundancy;
+int vomp_simulate_loss;
+int vomp_ptime = VOMP_FRAME_MS;
+
+// private codec number for audio carrying redundant copies of earlier frames,
+// listed with our codecs so servald only uses it if both ends understand it
+#define VOMP_CODEC_REDUNDANT 0x40
+// private codec number announcing that we number audio with one sequence number per 20ms
+// and split packets holding several frames, we only bundle frames for a far end that lists it
+#define VOMP_CODEC_BUNDLED 0x41
+// earlier frames are only repeated while the whole payload fits in this many bytes
+#define VOMP_REDUNDANT_PAYLOAD 1024
+#define VOMP_REDUNDANT_BLOCK 512
+// largest bundle of frames we send, 60ms of 16 bit linear
+#define VOMP_BUNDLE_BYTES 960
+
 static struct ast_channel_tech vomp_tech = {
 	.type             = "VOMP",
 	.description      = "Serval Vomp Channel Driver",
@@ -92,6 +126,7 @@ static struct ast_channel_tech vomp_tech = {
 	.write            = vomp_write,
 	.indicate         = vomp_indicate,
 	.fixup            = vomp_fixup,
+	.devicestate      = vomp_devicestate,
 };
 
 static struct ast_jb_conf jbconf =
@@ -103,16 +138,60 @@ static struct ast_jb_conf jbconf =
 	.target_extra = 40,
 };
 
+// a frame of audio, kept so it can be sent again with the frames that follow
+struct vomp_audio_block {
+	int codec;
+	int time;
+	int frames; // 20ms frames in this block
+	int len;
+	unsigned char data[VOMP_REDUNDANT_BLOCK];
+};
+
 struct vomp_channel {
 	int session_id; // call session id as returned by servald, used as the key for the channels collection
+	struct vomp_instance *instance; // the servald instance carrying this call, also part of the key
 	int chan_id; // unique number for generating a name for the channel
 	int channel_start; // time when we started the channel
 	int call_start; // time when we hit in-call
 	int initiated; // did asterisk start dialing?
 	struct ast_channel *owner;
+	char remote_sid[65]; // the other end of the call
+	struct vomp_timer timer; // setup, ringing or media inactivity timeout
+	int timeout_reason; // which of those the timer is currently measuring
+	long long last_audio; // time we last received audio from servald
+	int monitor_generation; // the last monitor connection that mentioned this session
+	struct vomp_channel *next_dial; // next outgoing call waiting for CALLTO
+	long long dial_time; // when we asked servald to place this call
+	int abandoned; // asterisk gave up before servald told us the session id
+	int offered_codecs; // codec mask that asterisk can accept for this call
+	int codecs; // codec mask that both ends can use, indexes codec_caps
+	int kbps; // estimated mesh bandwidth reserved on the instance for this call
+	int pooled; // preallocated, returned to the session pool instead of being freed
+	int redundant; // the far end can decode redundant audio
+	int bundled; // the far end can split packets holding several 20ms frames
+	// outgoing audio
+	struct vomp_audio_block tx_history[VOMP_REDUNDANCY_MAX];
+	int tx_history_next;
+	// our own clock, one sequence number for every 20ms of audio
+	int tx_time, tx_sequence;
+	int tx_frames;
+	int tx_ptime; // ms of audio in the last packet we sent
+	// frames waiting to be sent together
+	unsigned char tx_bundle[VOMP_BUNDLE_BYTES];
+	int tx_bundle_codec, tx_bundle_len, tx_bundle_time, tx_bundle_sequence, tx_bundle_frames;
+	// incoming audio, sequence numbers seen in the last 32 frames
+	int rx_started, rx_first, rx_highest;
+	unsigned rx_window;
+	int rx_frames, rx_recovered, rx_discarded;
+	// RFC 3550 interarrival jitter, in 1/16 ms
+	int rx_jitter;
+	long long rx_transit;
+	struct vomp_channel *next_free;
 };
 
-struct vomp_channel *dialed_call;
+#define VOMP_TIMEOUT_SETUP 1
+#define VOMP_TIMEOUT_RINGING 2
+#define VOMP_TIMEOUT_MEDIA 3
 
 struct monitor_command_handler monitor_handlers[]={
 	{.command="CALLFROM",      .handler=remote_call},
@@ -123,18 +202,153 @@ struct monitor_command_handler monitor_handlers[]={
 	{.command="AUDIO",         .handler=remote_audio},
 	{.command="CODECS",        .handler=remote_codecs},
 	{.command="LOOKUP",        .handler=remote_lookup},
-	{.command="KEEPALIVE",     .handler=remote_noop},
-	{.command="CALLSTATUS",    .handler=remote_noop},
+	{.command="KEEPALIVE",     .handler=remote_keepalive},
+	{.command="CALLSTATUS",    .handler=remote_callstatus},
+	{.command="NEWPEER",       .handler=remote_newpeer},
+	{.command="OLDPEER",       .handler=remote_oldpeer},
 	{.command="MONITORSTATUS", .handler=remote_noop},
 	{.command="MONITOR",       .handler=remote_noop},
 	{.command="INFO",          .handler=remote_noop},
 };
+#define MONITOR_HANDLER_COUNT (sizeof(monitor_handlers)/sizeof(struct monitor_command_handler))
+
+// hangups that couldn't be sent while disconnected, sent again if servald still has the session
+#define VOMP_ORPHANS_MAX 16
+
+// LOOKUP requests are answered in batches, after each read from the monitor connection
+#define LOOKUP_BATCH_MAX 32
+// monitor_client_writeline() formats each message into a buffer this big
+#define MONITOR_LINE_MAX 512
+// one "lookup match <sid> <port> <ext>" answer
+#define LOOKUP_LINE_MAX 128
+// the same broadcast often arrives more than once, from different neighbours or interfaces
+#define LOOKUP_RECENT 32
+#define LOOKUP_DEDUP_MS 2000
+
+struct vomp_lookup {
+	char sid[65];
+	char port[12];
+	char ext[32]; // servald limits DIDs to 31 digits
+	long long time;
+};
+
+// one servald daemon, with its own monitor connection and session namespace
+struct vomp_instance {
+	char name[32];
+	char path[256]; // SERVALINSTANCE_PATH of this daemon
+	int index;
+	int weight; // relative share of outgoing calls
+	int fd; // monitor connection, -1 while disconnected
+	struct monitor_state *state;
+	// copy of monitor_handlers with this instance as the context
+	struct monitor_command_handler handlers[MONITOR_HANDLER_COUNT];
+	
+	int backoff;
+	long long next_attempt;
+	
+	// bumped on each successful connection, sessions that servald doesn't mention
+	// within vomp_resync_timeout of a reconnect are assumed to be dead
+	int generation;
+	int resyncing;
+	struct vomp_timer resync_timer;
+	// our sessions that couldn't be hung up while disconnected, protected by write_lock
+	int orphans[VOMP_ORPHANS_MAX];
+	int orphan_count;
+	
+	int sessions; // sessions currently carried by this instance
+	int failures; // consecutive outgoing calls that never connected
+	int kbps; // estimated mesh bandwidth of those sessions
+	int rejected; // calls refused by admission control
+	
+	// outgoing calls waiting for servald to tell us their session id, oldest first
+	ast_mutex_t dial_lock;
+	struct vomp_channel *dial_head, *dial_tail;
+	
+	// held around every write to fd, so messages from different threads never interleave
+	ast_mutex_t write_lock;
+	
+	// servald lists the codecs of an incoming call before CALLFROM
+	int pending_session;
+	int pending_codecs;
+	int pending_redundant;
+	int pending_bundled;
+	
+	// LOOKUP requests waiting to be answered, and the requests we've seen lately
+	struct vomp_lookup lookup_batch[LOOKUP_BATCH_MAX];
+	int lookup_count;
+	struct vomp_lookup lookup_recent[LOOKUP_RECENT];
+	int lookup_recent_next;
+	int lookups, lookup_duplicates;
+};
+
+static struct vomp_instance *instances[VOMP_MAX_INSTANCES];
+static int instance_count;
+
+// outgoing calls avoid an instance that has failed this many times in a row, if another is available
+#define INSTANCE_FAILURE_LIMIT 3
+// abandoned calls that never got a CALLTO are forgotten after this long
+#define DIAL_QUEUE_EXPIRE_MS 60000
+
+// from serval-dna's instance.c, overrides SERVALINSTANCE_PATH without touching the environment
+void serval_setinstancepath(const char *instancepath);
+
+// the serval client libraries take no path, they work out socket addresses from the
+// process wide instance path every time they connect, send or receive
+AST_MUTEX_DEFINE_STATIC(instance_path_lock);
+// the path last given to serval_setinstancepath(), which leaks the old copy
+static char instance_path[256];
+
+// point the serval client libraries at this instance, until vomp_path_unlock()
+void vomp_path_lock(const char *path){
+	ast_mutex_lock(&instance_path_lock);
+	if (strcmp(instance_path, path)){
+		ast_copy_string(instance_path, path, sizeof(instance_path));
+		serval_setinstancepath(instance_path);
+	}
+}
+
+void vomp_path_unlock(void){
+	ast_mutex_unlock(&instance_path_lock);
+}
 
 int chan_id=0;
 // id for the monitor thread
-pthread_t thread;
+pthread_t thread = AST_PTHREADT_NULL;
+// set once vomp_register_channel has got as far as registering the channel tech
+static int channel_registered;
+// written to by unload to wake the monitor thread
+static int monitor_wake[2]={-1,-1};
+
+// delay between reconnection attempts doubles on each failure, up to the maximum
+#define RECONNECT_MIN_MS 50
+#define RECONNECT_MAX_MS 5000
+
+static void resync_expired(struct vomp_timer *timer);
 
 static struct ao2_container *channels;
+#define CHANNEL_BUCKETS 563
+
+// each vomp codec is a bit in a codec mask
+static const struct {
+	int vomp_codec;
+	enum ast_format_id format;
+	int kbps; // audio bit rate in each direction
+} codec_map[] = {
+	{VOMP_CODEC_ULAW,     AST_FORMAT_ULAW,      64},
+	{VOMP_CODEC_ALAW,     AST_FORMAT_ALAW,      64},
+	{VOMP_CODEC_16SIGNED, AST_FORMAT_SLINEAR,   128},
+	{VOMP_CODEC_GSM,      AST_FORMAT_GSM,       13},
+};
+#define CODEC_COUNT (sizeof(codec_map)/sizeof(codec_map[0]))
+#define CODEC_MASK_ALL ((1<<CODEC_COUNT)-1)
+
+// one capability set and preferred format for every codec mask, built at load time and never modified
+// sessions copy from these into the channel's native formats instead of building and leaking
+// a cap of their own, though ast_format_cap_copy() still allocates an entry for each format
+static struct ast_format_cap *codec_caps[CODEC_MASK_ALL+1];
+static struct ast_format codec_best[CODEC_MASK_ALL+1];
+// estimated mesh bandwidth of a call using the preferred format, in both directions
+static int codec_kbps[CODEC_MASK_ALL+1];
 
 static long long gettime_ms(void)
 {
@@ -143,24 +357,373 @@ static long long gettime_ms(void)
 	return nowtv.tv_sec * 1000LL + nowtv.tv_usec / 1000;
 }
 
+// with max_calls set, every session is allocated up front
+// the pool keeps a reference to each slot, a slot is free again once that is the only reference left
+static struct vomp_channel **session_pool;
+static struct vomp_channel *pool_free;
+static int pool_size;
+static int pool_in_use;
+AST_MUTEX_DEFINE_STATIC(pool_lock);
+
+// account for the mesh bandwidth the session is expected to use
+static void reserve_bandwidth(struct vomp_channel *vomp_state, int kbps){
+	ast_atomic_fetchadd_int(&vomp_state->instance->kbps, kbps - vomp_state->kbps);
+	vomp_state->kbps = kbps;
+}
+
+// the session is finished with, stop counting it
+static void session_retire(struct vomp_channel *vomp_state){
+	reserve_bandwidth(vomp_state, 0);
+	ast_atomic_fetchadd_int(&vomp_state->instance->sessions, -1);
+	if (vomp_state->remote_sid[0])
+		vomp_peer_call_count(vomp_state->remote_sid, -1);
+}
+
 static void vomp_channel_destructor(void *obj){
-	// noop...
+	struct vomp_channel *vomp_state = obj;
+	// pooled sessions were retired when they went back to the pool
+	if (!vomp_state->pooled)
+		session_retire(vomp_state);
 }
 
-static struct vomp_channel *new_vomp_channel(void){
+// release a reference to a session, returning it to the pool if nothing else holds it
+static void release_channel(struct vomp_channel *vomp_state){
+	if (!vomp_state->pooled){
+		ao2_ref(vomp_state, -1);
+		return;
+	}
+	if (ao2_ref(vomp_state, -1) == 2){
+		session_retire(vomp_state);
+		ast_mutex_lock(&pool_lock);
+		vomp_state->next_free = pool_free;
+		pool_free = vomp_state;
+		pool_in_use--;
+		ast_mutex_unlock(&pool_lock);
+	}
+}
+
+static int session_pool_init(int size){
+	int i;
+	session_pool = ast_calloc(size, sizeof(struct vomp_channel *));
+	if (!session_pool)
+		return -1;
+	for (i=0;i<size;i++){
+		struct vomp_channel *vomp_state = ao2_alloc(sizeof(struct vomp_channel), vomp_channel_destructor);
+		if (!vomp_state)
+			return -1;
+		vomp_state->pooled = 1;
+		vomp_state->next_free = pool_free;
+		pool_free = vomp_state;
+		session_pool[i] = vomp_state;
+		pool_size++;
+	}
+	return 0;
+}
+
+static void session_pool_destroy(void){
+	int i;
+	if (!session_pool)
+		return;
+	for (i=0;i<pool_size;i++)
+		ao2_ref(session_pool[i], -1);
+	ast_free(session_pool);
+	session_pool = NULL;
+	pool_free = NULL;
+	pool_size = pool_in_use = 0;
+}
+
+static int codec_bit(int vomp_codec){
+	int i;
+	for (i=0;i<CODEC_COUNT;i++){
+		if (codec_map[i].vomp_codec == vomp_codec)
+			return 1<<i;
+	}
+	return 0;
+}
+
+// the codecs in cap that servald can carry
+static int codec_mask(struct ast_format_cap *cap){
+	struct ast_format tmpfmt;
+	int i, mask=0;
+	for (i=0;i<CODEC_COUNT;i++){
+		if (ast_format_cap_iscompatible(cap, ast_format_set(&tmpfmt, codec_map[i].format, 0)))
+			mask |= 1<<i;
+	}
+	return mask;
+}
+
+// bytes in 20ms of audio, or 0 if the codec can't be split into frames
+static int codec_frame_bytes(int vomp_codec){
+	switch (vomp_codec){
+		case VOMP_CODEC_ULAW:
+		case VOMP_CODEC_ALAW:
+			return 160;
+		case VOMP_CODEC_16SIGNED:
+			return 320;
+		case VOMP_CODEC_GSM:
+			return 33;
+	}
+	return 0;
+}
+
+static int codec_caps_init(void){
+	struct ast_format tmpfmt;
+	int mask, i;
+	for (mask=0;mask<=CODEC_MASK_ALL;mask++){
+		codec_caps[mask] = ast_format_cap_alloc_nolock();
+		if (!codec_caps[mask])
+			return -1;
+		for (i=0;i<CODEC_COUNT;i++){
+			if (mask & (1<<i))
+				ast_format_cap_add(codec_caps[mask], ast_format_set(&tmpfmt, codec_map[i].format, 0));
+		}
+		if (!mask)
+			continue;
+		ast_best_codec(codec_caps[mask], &codec_best[mask]);
+		for (i=0;i<CODEC_COUNT;i++){
+			if (codec_map[i].format == codec_best[mask].id)
+				codec_kbps[mask] = codec_map[i].kbps * 2;
+		}
+	}
+	return 0;
+}
+
+static void codec_caps_destroy(void){
+	int mask;
+	for (mask=0;mask<=CODEC_MASK_ALL;mask++){
+		if (codec_caps[mask])
+			codec_caps[mask] = ast_format_cap_destroy(codec_caps[mask]);
+	}
+}
+
+// each redundant copy costs as much again as the audio itself
+static int session_kbps(int codecs, int redundant){
+	return codec_kbps[codecs] * (1 + (redundant ? vomp_redundancy : 0));
+}
+
+// narrow the session to the codecs that both ends can use
+static void set_codecs(struct vomp_channel *vomp_state, int remote_codecs, int redundant, int bundled){
+	struct ast_channel *owner = NULL;
+	
+	ao2_lock(vomp_state);
+	int codecs = remote_codecs & vomp_state->offered_codecs;
+	vomp_state->redundant = redundant && vomp_redundancy > 0;
+	vomp_state->bundled = bundled;
+	if (codecs)
+		reserve_bandwidth(vomp_state, session_kbps(codecs, vomp_state->redundant));
+	if (codecs && codecs != vomp_state->codecs){
+		vomp_state->codecs = codecs;
+		if (vomp_state->owner)
+			owner = ast_channel_ref(vomp_state->owner);
+	}
+	ao2_unlock(vomp_state);
+	
+	if (!codecs)
+		ast_log(LOG_WARNING, "Session %06x has no codecs in common\n", vomp_state->session_id);
+	
+	if (owner){
+		ast_channel_lock(owner);
+		ast_format_cap_copy(ast_channel_nativeformats(owner), codec_caps[codecs]);
+		ast_channel_unlock(owner);
+		ast_set_write_format(owner, &codec_best[codecs]);
+		ast_channel_unref(owner);
+	}
+}
+
+static void session_timeout(struct vomp_timer *timer);
+
+static struct vomp_channel *new_vomp_channel(struct vomp_instance *instance){
 	struct vomp_channel *vomp_state;
-	vomp_state = ao2_alloc(sizeof(struct vomp_channel), vomp_channel_destructor);
+	if (session_pool){
+		ast_mutex_lock(&pool_lock);
+		vomp_state = pool_free;
+		if (vomp_state){
+			pool_free = vomp_state->next_free;
+			pool_in_use++;
+		}
+		ast_mutex_unlock(&pool_lock);
+		if (!vomp_state){
+			ast_log(LOG_WARNING, "All %d sessions are in use\n", pool_size);
+			return NULL;
+		}
+		memset(vomp_state, 0, sizeof(struct vomp_channel));
+		vomp_state->pooled = 1;
+		// the caller's reference, the pool keeps its own
+		ao2_ref(vomp_state, +1);
+	}else{
+		vomp_state = ao2_alloc(sizeof(struct vomp_channel), vomp_channel_destructor);
+		if (!vomp_state)
+			return NULL;
+	}
 	
 	// allocate a unique number for this channel
 	vomp_state->chan_id = ast_atomic_fetchadd_int(&chan_id, +1);
 	vomp_state->channel_start = gettime_ms();
+	vomp_state->instance = instance;
+	ast_atomic_fetchadd_int(&instance->sessions, +1);
+	vomp_state->timer.callback = session_timeout;
+	vomp_state->timer.context = vomp_state;
+	// until the far end tells us otherwise
+	vomp_state->offered_codecs = CODEC_MASK_ALL;
+	vomp_state->codecs = codec_bit(VOMP_CODEC_16SIGNED);
 	
 	return vomp_state;
 }
 
+// queue an outgoing call until servald tells us its session id
+// the queue holds a reference to the session
+static void dial_queue_push(struct vomp_channel *vomp_state){
+	struct vomp_instance *instance = vomp_state->instance;
+	long long now = gettime_ms();
+	struct vomp_channel **p;
+	
+	ao2_ref(vomp_state, +1);
+	vomp_state->dial_time = now;
+	
+	ast_mutex_lock(&instance->dial_lock);
+	// forget abandoned calls that servald must have refused
+	instance->dial_tail = NULL;
+	for (p = &instance->dial_head; *p; ){
+		struct vomp_channel *old = *p;
+		if (old->abandoned && now - old->dial_time > DIAL_QUEUE_EXPIRE_MS){
+			*p = old->next_dial;
+			old->next_dial = NULL;
+			release_channel(old);
+			continue;
+		}
+		instance->dial_tail = old;
+		p = &old->next_dial;
+	}
+	
+	if (instance->dial_tail)
+		instance->dial_tail->next_dial = vomp_state;
+	else
+		instance->dial_head = vomp_state;
+	instance->dial_tail = vomp_state;
+	ast_mutex_unlock(&instance->dial_lock);
+}
+
+// take the pending call that matches CALLTO, falling back to the oldest
+// the caller must release the returned reference
+static struct vomp_channel *dial_queue_pop(struct vomp_instance *instance, const char *remote_sid){
+	struct vomp_channel *prev = NULL, *match;
+	
+	ast_mutex_lock(&instance->dial_lock);
+	for (match = instance->dial_head; match; prev = match, match = match->next_dial){
+		if (remote_sid && !strcasecmp(match->remote_sid, remote_sid))
+			break;
+	}
+	if (!match){
+		prev = NULL;
+		match = instance->dial_head;
+	}
+	if (match){
+		if (prev)
+			prev->next_dial = match->next_dial;
+		else
+			instance->dial_head = match->next_dial;
+		if (instance->dial_tail == match)
+			instance->dial_tail = prev;
+		match->next_dial = NULL;
+	}
+	ast_mutex_unlock(&instance->dial_lock);
+	return match;
+}
+
+// if the call is still waiting for CALLTO, hang up the session when it arrives
+// otherwise forget the session, returning its id so the caller can hang it up
+// remote_dialing links sessions under the same lock, so exactly one of us sends the hangup
+static int dial_queue_abandon(struct vomp_channel *vomp_state){
+	struct vomp_instance *instance = vomp_state->instance;
+	int session_id;
+	ast_mutex_lock(&instance->dial_lock);
+	vomp_state->abandoned = 1;
+	session_id = vomp_state->session_id;
+	ao2_unlink(channels, vomp_state);
+	ast_mutex_unlock(&instance->dial_lock);
+	return session_id;
+}
+
+// an armed timer holds a reference to the session, released when it fires or is cancelled
+static void clear_timeout(struct vomp_channel *vomp_state){
+	if (vomp_timer_cancel(&vomp_state->timer))
+		release_channel(vomp_state);
+}
+
+static void set_timeout(struct vomp_channel *vomp_state, int reason, int delay_ms){
+	if (delay_ms<=0){
+		clear_timeout(vomp_state);
+		return;
+	}
+	// session_timeout reads the reason under the same lock, and ignores a timer armed since it expired
+	ao2_lock(vomp_state);
+	vomp_state->timeout_reason = reason;
+	if (reason == VOMP_TIMEOUT_MEDIA)
+		vomp_state->last_audio = gettime_ms();
+	if (vomp_timer_set(&vomp_state->timer, delay_ms))
+		ao2_ref(vomp_state, +1);
+	ao2_unlock(vomp_state);
+}
+
+// called from the timer thread when a session has been stuck in one state for too long
+static void session_timeout(struct vomp_timer *timer){
+	struct vomp_channel *vomp_state = timer->context;
+	struct ast_channel *owner = NULL;
+	int cause = 0, unreached = 0;
+	
+	ao2_lock(vomp_state);
+	if (!vomp_timer_current(timer)){
+		// set or cleared again after this expired, the new state has its own timer
+		ao2_unlock(vomp_state);
+		release_channel(vomp_state);
+		return;
+	}
+	switch(vomp_state->timeout_reason){
+		case VOMP_TIMEOUT_MEDIA:{
+			long long idle = gettime_ms() - vomp_state->last_audio;
+			if (idle < vomp_media_timeout){
+				// audio has arrived since the timer was armed, check again later
+				if (vomp_timer_set(timer, vomp_media_timeout - idle))
+					ao2_ref(vomp_state, +1);
+				break;
+			}
+			ast_log(LOG_WARNING, "No audio for session %06x in %lldms, hanging up\n", vomp_state->session_id, idle);
+			cause = AST_CAUSE_RECOVERY_ON_TIMER_EXPIRE;
+			break;
+		}
+		case VOMP_TIMEOUT_RINGING:
+			ast_log(LOG_WARNING, "Session %06x was not answered, hanging up\n", vomp_state->session_id);
+			cause = AST_CAUSE_NO_ANSWER;
+			break;
+		default:
+			ast_log(LOG_WARNING, "Session %06x failed to connect via %s, hanging up\n",
+				vomp_state->session_id, vomp_state->instance->name);
+			vomp_state->instance->failures++;
+			unreached = vomp_state->initiated;
+			cause = AST_CAUSE_NO_USER_RESPONSE;
+			break;
+	}
+	if (cause && vomp_state->owner)
+		owner = ast_channel_ref(vomp_state->owner);
+	ao2_unlock(vomp_state);
+	
+	if (cause)
+		dial_queue_abandon(vomp_state);
+	if (unreached)
+		vomp_peer_call_result(vomp_state->remote_sid, 0);
+	
+	if (owner){
+		// let vomp_hangup release everything else
+		ast_queue_hangup_with_cause(owner, cause);
+		ast_channel_unref(owner);
+	}
+	release_channel(vomp_state);
+}
+
 static void set_session_id(struct vomp_channel *vomp_state, int session_id){
-	ast_log(LOG_WARNING, "Adding session %06x\n",session_id);
+	ast_log(LOG_WARNING, "Adding session %s/%06x\n", vomp_state->instance->name, session_id);
 	vomp_state->session_id = session_id;
+	vomp_state->monitor_generation = vomp_state->instance->generation;
 	ao2_link(channels, vomp_state);
 }
 
@@ -171,24 +734,20 @@ static struct ast_channel *new_channel(struct vomp_channel *vomp_state, const in
 	
 	ao2_lock(vomp_state);
 	
-	struct ast_format_cap *cap = ast_format_cap_alloc(); //TODO AST_FORMAT_CAP_FLAG_DEFAULT
-	if (cap){
-		ast = ast_channel_alloc(1, state, NULL, NULL, NULL, ext, context, NULL, 0, "VoMP/%08x", vomp_state->chan_id);
-		
-		struct ast_format tmpfmt;
-		ast_format_set(&tmpfmt, AST_FORMAT_SLINEAR16, 0);
+	ast = ast_channel_alloc(1, state, NULL, NULL, NULL, ext, context, NULL, 0, "VoMP/%08x", vomp_state->chan_id);
+	if (ast){
+		int codecs = vomp_state->codecs;
+		ast_format_cap_copy(ast_channel_nativeformats(ast), codec_caps[codecs]);
 		
-		ast_format_cap_add(cap, &tmpfmt);
-		ast_channel_nativeformats_set(ast, cap);
-		
-		ast_set_read_format(ast, &tmpfmt);
-		ast_set_write_format(ast, &tmpfmt);
+		ast_set_read_format(ast, &codec_best[codecs]);
+		ast_set_write_format(ast, &codec_best[codecs]);
 		
 		ast_channel_tech_set(ast, &vomp_tech);
 		ast_channel_tech_pvt_set(ast, vomp_state);
 		vomp_state->owner = ast; // add ref?
 		
 		ast_jb_configure(ast, &jbconf);
+		pbx_builtin_setvar_helper(ast, "VOMP_INSTANCE", vomp_state->instance->name);
 		
 		ast_channel_unlock(ast);
 	}
@@ -197,69 +756,291 @@ static struct ast_channel *new_channel(struct vomp_channel *vomp_state, const in
 }
 
 
+// bytes we've written to servald that it hasn't read yet
+static int monitor_queue_depth(struct vomp_instance *instance){
+	int pending = 0;
+#if defined(SIOCOUTQ)
+	if (ioctl(instance->fd, SIOCOUTQ, &pending)==0)
+		return pending;
+#elif defined(TIOCOUTQ)
+	if (ioctl(instance->fd, TIOCOUTQ, &pending)==0)
+		return pending;
+#elif defined(SO_NWRITE)
+	socklen_t len = sizeof(pending);
+	if (getsockopt(instance->fd, SOL_SOCKET, SO_NWRITE, &pending, &len)==0)
+		return pending;
+#endif
+	return 0;
+}
+
+static int total_sessions(void){
+	int i, total=0;
+	for (i=0;i<instance_count;i++)
+		total += instances[i]->sessions;
+	return total;
+}
+
+// admission control for limits that apply across every instance
+// returns the limit that another call would exceed, or NULL
+static const char *admission_check(const char *sid){
+	if (vomp_max_sessions > 0 && total_sessions() >= vomp_max_sessions)
+		return "max_sessions";
+	if (vomp_max_peer_calls > 0 && sid && vomp_peer_calls(sid) >= vomp_max_peer_calls)
+		return "max_peer_calls";
+	return NULL;
+}
+
+// admission control for limits of this instance's mesh link
+static const char *instance_admission_check(struct vomp_instance *instance, int kbps){
+	if (vomp_max_bandwidth > 0 && instance->kbps + kbps > vomp_max_bandwidth)
+		return "max_bandwidth";
+	if (vomp_max_queue > 0 && monitor_queue_depth(instance) > vomp_max_queue)
+		return "max_queue";
+	return NULL;
+}
+
+
 // functions for handling incoming vomp events
 
 // find the channel struct from the servald token
 // note that ao2_find adds a reference to the returned object that must be released
-struct vomp_channel *get_channel(char *token){
+static struct vomp_channel *find_channel(struct vomp_instance *instance, int session_id){
 	struct vomp_channel search={
-		.session_id=strtol(token, NULL, 16),
+		.session_id=session_id,
+		.instance=instance,
 	};
 	struct vomp_channel *ret = ao2_find(channels, &search, OBJ_POINTER);
+	// servald still knows about this session
+	if (ret)
+		ret->monitor_generation = instance->generation;
+	return ret;
+}
+
+struct vomp_channel *get_channel(struct vomp_instance *instance, char *token){
+	int session_id = strtol(token, NULL, 16);
+	struct vomp_channel *ret = find_channel(instance, session_id);
 	if (ret==NULL)
-		ast_log(LOG_WARNING, "Failed to find call structure for session %s (%06x)\n",token,search.session_id);
+		ast_log(LOG_WARNING, "Failed to find call structure for session %s/%s (%06x)\n",instance->name,token,session_id);
 	return ret;
 }
 
 // Send outgoing monitor messages
 
 // TODO fix servald, commands are currently case sensitive
-static void send_hangup(int session_id){
-	monitor_client_writeline(monitor_client_fd, "hangup %06x\n",session_id);
+static void send_hangup(struct vomp_instance *instance, int session_id){
+	ast_mutex_lock(&instance->write_lock);
+	if (monitor_client_writeline(instance->fd, "hangup %06x\n",session_id)<0 && session_id){
+		// remember it for the resync, forgetting the oldest if there are too many
+		if (instance->orphan_count >= VOMP_ORPHANS_MAX){
+			memmove(instance->orphans, instance->orphans+1, sizeof(int) * (VOMP_ORPHANS_MAX-1));
+			instance->orphan_count--;
+		}
+		instance->orphans[instance->orphan_count++] = session_id;
+	}
+	ast_mutex_unlock(&instance->write_lock);
+}
+
+// was this one of our sessions that we couldn't hang up? forgets it either way
+static int orphan_take(struct vomp_instance *instance, int session_id){
+	int i, found=0;
+	ast_mutex_lock(&instance->write_lock);
+	for (i=0;i<instance->orphan_count;i++){
+		if (instance->orphans[i] == session_id){
+			instance->orphans[i] = instance->orphans[--instance->orphan_count];
+			found=1;
+			break;
+		}
+	}
+	ast_mutex_unlock(&instance->write_lock);
+	return found;
 }
 static void send_ringing(struct vomp_channel *vomp_state){
-	monitor_client_writeline(monitor_client_fd, "ringing %06x\n",vomp_state->session_id);
+	struct vomp_instance *instance = vomp_state->instance;
+	ast_mutex_lock(&instance->write_lock);
+	monitor_client_writeline(instance->fd, "ringing %06x\n",vomp_state->session_id);
+	ast_mutex_unlock(&instance->write_lock);
 }
 static void send_pickup(struct vomp_channel *vomp_state){
-	monitor_client_writeline(monitor_client_fd, "pickup %06x\n",vomp_state->session_id);
+	struct vomp_instance *instance = vomp_state->instance;
+	ast_mutex_lock(&instance->write_lock);
+	monitor_client_writeline(instance->fd, "pickup %06x\n",vomp_state->session_id);
+	ast_mutex_unlock(&instance->write_lock);
 }
-static void send_call(const char *sid, const char *caller_id, const char *remote_ext){
-	monitor_client_writeline(monitor_client_fd, "call %s %s %s\n", sid, caller_id, remote_ext);
+static void send_call(struct vomp_instance *instance, const char *sid, const char *caller_id, const char *remote_ext){
+	ast_mutex_lock(&instance->write_lock);
+	monitor_client_writeline(instance->fd, "call %s %s %s\n", sid, caller_id, remote_ext);
+	ast_mutex_unlock(&instance->write_lock);
 }
 static void send_audio(struct vomp_channel *vomp_state, unsigned char *buffer, int len, int codec, int time, int sequence){
-	monitor_client_writeline_and_data(monitor_client_fd, buffer, len, "audio %06x %d %d %d\n", 
+	struct vomp_instance *instance = vomp_state->instance;
+	ast_mutex_lock(&instance->write_lock);
+	monitor_client_writeline_and_data(instance->fd, buffer, len, "audio %06x %d %d %d\n", 
 					  vomp_state->session_id, codec, time, sequence);
+	ast_mutex_unlock(&instance->write_lock);
+}
+// send audio with copies of the frames before it, see queue_redundant_audio
+static void send_redundant_audio(struct vomp_channel *vomp_state, unsigned char *buffer, int len, int codec, int time, int sequence, int frames){
+	unsigned char payload[VOMP_REDUNDANT_PAYLOAD];
+	struct vomp_audio_block *blocks[VOMP_REDUNDANCY_MAX];
+	int count=0, i, pos=0, size=len+1, expect=time;
+	
+	// most recent first, as many as will fit, the far end works out their sequence numbers from the time offset
+	for (i=1;i<=vomp_redundancy && i<=VOMP_REDUNDANCY_MAX;i++){
+		struct vomp_audio_block *block = &vomp_state->tx_history[
+			(vomp_state->tx_history_next + VOMP_REDUNDANCY_MAX - i) % VOMP_REDUNDANCY_MAX];
+		int offset = time - block->time;
+		if (!block->len || block->time + block->frames * VOMP_FRAME_MS != expect || offset > 0x3fff)
+			break;
+		expect = block->time;
+		if (size + block->len + 4 > sizeof(payload))
+			break;
+		size += block->len + 4;
+		blocks[count++] = block;
+	}
+	
+	if (size > sizeof(payload)){
+		send_audio(vomp_state, buffer, len, codec, time, sequence);
+	}else{
+		for (i=count-1;i>=0;i--){
+			int offset = time - blocks[i]->time;
+			payload[pos++] = 0x80 | blocks[i]->codec;
+			payload[pos++] = offset >> 6;
+			payload[pos++] = ((offset & 0x3f) << 2) | (blocks[i]->len >> 8);
+			payload[pos++] = blocks[i]->len & 0xff;
+		}
+		payload[pos++] = codec;
+		for (i=count-1;i>=0;i--){
+			memcpy(payload+pos, blocks[i]->data, blocks[i]->len);
+			pos += blocks[i]->len;
+		}
+		memcpy(payload+pos, buffer, len);
+		pos += len;
+		send_audio(vomp_state, payload, pos, VOMP_CODEC_REDUNDANT, time, sequence);
+	}
+	
+	// remember this frame for next time
+	struct vomp_audio_block *block = &vomp_state->tx_history[vomp_state->tx_history_next];
+	vomp_state->tx_history_next = (vomp_state->tx_history_next + 1) % VOMP_REDUNDANCY_MAX;
+	if (len > sizeof(block->data)){
+		block->len = 0;
+		return;
+	}
+	block->codec = codec;
+	block->time = time;
+	block->frames = frames;
+	block->len = len;
+	memcpy(block->data, buffer, len);
+}
+
+// send a packet of one or more frames, using our own clock
+static void send_frames(struct vomp_channel *vomp_state, unsigned char *buffer, int len, int codec, int time, int sequence, int frames){
+	vomp_state->tx_ptime = frames * VOMP_FRAME_MS;
+	if (vomp_state->redundant)
+		send_redundant_audio(vomp_state, buffer, len, codec, time, sequence, frames);
+	else
+		send_audio(vomp_state, buffer, len, codec, time, sequence);
+}
+
+static void flush_audio(struct vomp_channel *vomp_state){
+	if (!vomp_state->tx_bundle_len)
+		return;
+	send_frames(vomp_state, vomp_state->tx_bundle, vomp_state->tx_bundle_len, vomp_state->tx_bundle_codec,
+		    vomp_state->tx_bundle_time, vomp_state->tx_bundle_sequence, vomp_state->tx_bundle_frames);
+	vomp_state->tx_bundle_len = 0;
+	vomp_state->tx_bundle_frames = 0;
 }
-static void send_lookup_response(const char *sid, const char *port, const char *ext, const char *name){
-	ast_log(LOG_WARNING, "lookup match \"%s\" \"%s\" \"%s\" \"%s\"\n", sid, port, ext, name);
-	monitor_client_writeline(monitor_client_fd, "lookup match %s %s %s %s\n", sid, port, ext, name);
+
+// how much audio to send in each packet
+// with packetization=auto, fewer larger packets for narrowband codecs, unless the path is already jittery
+static int session_ptime(struct vomp_channel *vomp_state, int codec){
+	if (vomp_ptime > 0)
+		return vomp_ptime;
+	int ptime = codec == VOMP_CODEC_GSM ? 60 : codec == VOMP_CODEC_16SIGNED ? 20 : 40;
+	int jitter = vomp_state->rx_jitter / 16;
+	if (jitter >= 80)
+		ptime = 20;
+	else if (jitter >= 40 && ptime > 40)
+		ptime = 40;
+	return ptime;
 }
 
 // CALLTO [token] [localsid] [localdid] [remotesid] [remotedid]
 // sent so that we can link an outgoing call to a servald session id
 static int remote_dialing(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+	struct vomp_instance *instance = context;
 	ast_log(LOG_WARNING, "remote_dialing\n");
-	if (!dialed_call)
+	int session_id = strtol(argv[0], NULL, 16);
+	struct vomp_channel *vomp_state = dial_queue_pop(instance, argc>3 ? argv[3] : NULL);
+	if (!vomp_state)
 		return 0;
+	
+	ast_mutex_lock(&instance->dial_lock);
+	int abandoned = vomp_state->abandoned;
 	// add the vomp state to our collection so we can find it later
-	set_session_id(dialed_call, strtol(argv[0], NULL, 16));
-	dialed_call=NULL;
+	if (!abandoned)
+		set_session_id(vomp_state, session_id);
+	ast_mutex_unlock(&instance->dial_lock);
+	
+	// asterisk has already given up on this call
+	if (abandoned)
+		send_hangup(instance, session_id);
+	release_channel(vomp_state);
 	return 1;
 }
 
 // CALLFROM [token] [localsid] [localdid] [remotesid] [remotedid]
 static int remote_call(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+	struct vomp_instance *instance = context;
 	// TODO fix servald and other VOMP clients to pass extension correctly
 	// TODO add callerid...
 	char *ext = argv[2];
 	int session_id=strtol(argv[0], NULL, 16);
 	
 	if (ast_exists_extension(NULL, incoming_context, ext, 1, NULL)) {
-		struct vomp_channel *vomp_state=new_vomp_channel();
+		int codecs = codec_bit(VOMP_CODEC_16SIGNED), redundant = 0;
+		if (instance->pending_session == session_id && instance->pending_codecs){
+			codecs = instance->pending_codecs;
+			redundant = instance->pending_redundant && vomp_redundancy > 0;
+		}
+		
+		const char *limit = admission_check(argc>3 ? argv[3] : NULL);
+		if (!limit)
+			limit = instance_admission_check(instance, session_kbps(codecs, redundant));
+		if (limit){
+			ast_log(LOG_WARNING, "Refusing call from %s, %s reached\n", argc>3 ? argv[3] : "unknown", limit);
+			instance->rejected++;
+			send_hangup(instance, session_id);
+			return 0;
+		}
+		
+		struct vomp_channel *vomp_state=new_vomp_channel(instance);
+		if (!vomp_state){
+			send_hangup(instance, session_id);
+			return 0;
+		}
+		if (argc>3){
+			ast_copy_string(vomp_state->remote_sid, argv[3], sizeof(vomp_state->remote_sid));
+			vomp_peer_call_count(vomp_state->remote_sid, +1);
+		}
 		set_session_id(vomp_state, session_id);
 		vomp_state->initiated=0;
+		if (instance->pending_session == session_id && instance->pending_codecs){
+			set_codecs(vomp_state, instance->pending_codecs, instance->pending_redundant, instance->pending_bundled);
+			instance->pending_codecs = 0;
+		}
+		if (!vomp_state->kbps)
+			reserve_bandwidth(vomp_state, codec_kbps[vomp_state->codecs]);
 		
 		struct ast_channel *ast = new_channel(vomp_state, AST_STATE_RINGING, incoming_context, ext);
+		if (!ast){
+			ast_log(LOG_WARNING, "Unable to allocate channel for call to %s@%s\n", ext, incoming_context);
+			ao2_unlink(channels, vomp_state);
+			send_hangup(instance, session_id);
+			release_channel(vomp_state);
+			return 0;
+		}
+		// don't leave the caller ringing forever if the dialplan never answers
+		set_timeout(vomp_state, VOMP_TIMEOUT_RINGING, vomp_ring_timeout);
 		ast_log(LOG_WARNING, "Placing call to %s@%s\n", ext, incoming_context);
 		if (ast_pbx_start(ast)) {
 			ast_channel_hangupcause_set(ast, AST_CAUSE_SWITCH_CONGESTION);
@@ -270,35 +1051,128 @@ static int remote_call(char *cmd, int argc, char **argv, unsigned char *data, in
 		return 1;
 	}
 	ast_log(LOG_ERROR, "Extension \"%s\" not found\n", ext);
-	send_hangup(session_id);
+	send_hangup(instance, session_id);
 	return 0;
 }
 
-static int remote_lookup(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
-	if (monitor_resolve_numbers){
-		char *sid = argv[0];
-		char *port = argv[1];
-		char *ext = argv[2];
-		ast_log(LOG_WARNING, "remote_lookup %s, %s, %s\n", sid, port, ext);
-		if (ast_exists_extension(NULL, incoming_context, ext, 1, NULL)) {
-			send_lookup_response(sid, port, ext, "");
+// write the whole buffer, servald reads our answers as a stream of lines
+// called with write_lock held
+static void lookup_write(struct vomp_instance *instance, const char *buf){
+	if (monitor_client_writeline(instance->fd, "%s", buf)<0)
+		ast_log(LOG_WARNING, "Unable to answer lookups from %s: %s\n", instance->name, strerror(errno));
+}
+
+// answer every lookup we've collected, with as few writes as possible
+// the dialplan is searched first, write_lock is only held while the answers are written
+static void lookup_flush(struct vomp_instance *instance){
+	char lines[LOOKUP_BATCH_MAX][LOOKUP_LINE_MAX];
+	char buf[MONITOR_LINE_MAX];
+	int found[LOOKUP_BATCH_MAX];
+	int i, j, count=0, len=0;
+	
+	if (!instance->lookup_count)
+		return;
+	for (i=0;i<instance->lookup_count;i++){
+		struct vomp_lookup *lookup = &instance->lookup_batch[i];
+		
+		// several peers often ask for the same number at once
+		found[i] = -1;
+		for (j=0;j<i;j++){
+			if (!strcmp(instance->lookup_batch[j].ext, lookup->ext)){
+				found[i] = found[j];
+				break;
+			}
 		}
+		if (found[i]<0)
+			found[i] = ast_exists_extension(NULL, incoming_context, lookup->ext, 1, NULL) ? 1 : 0;
+		if (!found[i])
+			continue;
+		
+		ast_debug(1, "lookup match \"%s\" \"%s\" \"%s\"\n", lookup->sid, lookup->port, lookup->ext);
+		snprintf(lines[count++], LOOKUP_LINE_MAX, "lookup match %s %s %s %s\n", lookup->sid, lookup->port, lookup->ext, "");
+	}
+	instance->lookup_count = 0;
+	if (!count)
+		return;
+	
+	// pack the answers into as few writes as fit in the monitor client's buffer
+	ast_mutex_lock(&instance->write_lock);
+	for (i=0;i<count;i++){
+		int n = strlen(lines[i]);
+		if (len + n >= sizeof(buf)){
+			lookup_write(instance, buf);
+			len = 0;
+		}
+		memcpy(buf+len, lines[i], n+1);
+		len += n;
+	}
+	lookup_write(instance, buf);
+	ast_mutex_unlock(&instance->write_lock);
+}
+
+// have we been asked this within the last LOOKUP_DEDUP_MS?
+static int lookup_seen(struct vomp_instance *instance, const char *sid, const char *port, const char *ext, long long now){
+	int i;
+	for (i=0;i<LOOKUP_RECENT;i++){
+		struct vomp_lookup *lookup = &instance->lookup_recent[i];
+		if (lookup->time && now - lookup->time < LOOKUP_DEDUP_MS
+			&& !strcmp(lookup->ext, ext) && !strcmp(lookup->port, port) && !strcasecmp(lookup->sid, sid))
+			return 1;
+	}
+	return 0;
+}
+
+// LOOKUP [sid] [port] [ext]
+static int remote_lookup(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+	struct vomp_instance *instance = context;
+	if (!monitor_resolve_numbers || argc<3)
+		return 1;
+	
+	char *sid = argv[0];
+	char *port = argv[1];
+	char *ext = argv[2];
+	struct vomp_lookup *lookup = &instance->lookup_recent[instance->lookup_recent_next];
+	long long now = gettime_ms();
+	
+	instance->lookups++;
+	if (strlen(sid) >= sizeof(lookup->sid) || strlen(port) >= sizeof(lookup->port) || strlen(ext) >= sizeof(lookup->ext)){
+		ast_debug(1, "Ignoring malformed lookup %s, %s, %s\n", sid, port, ext);
+		return 1;
+	}
+	if (lookup_seen(instance, sid, port, ext, now)){
+		instance->lookup_duplicates++;
+		return 1;
 	}
+	
+	strcpy(lookup->sid, sid);
+	strcpy(lookup->port, port);
+	strcpy(lookup->ext, ext);
+	lookup->time = now;
+	instance->lookup_recent_next = (instance->lookup_recent_next + 1) % LOOKUP_RECENT;
+	
+	if (instance->lookup_count >= LOOKUP_BATCH_MAX)
+		lookup_flush(instance);
+	instance->lookup_batch[instance->lookup_count++] = *lookup;
 	return 1;
 }
 
 static int remote_pickup(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
 	int ret=0;
 	ast_log(LOG_WARNING, "remote_pickup\n");
-	struct vomp_channel *vomp_state=get_channel(argv[0]);
+	struct vomp_channel *vomp_state=get_channel(context, argv[0]);
 	if (vomp_state){
 		if (vomp_state->owner){
 			// stop any audio indications on the channel
 			ast_indicate(vomp_state->owner, -1);
 			// yay, we're INCALL
 			ast_queue_control(vomp_state->owner, AST_CONTROL_ANSWER);
+			set_timeout(vomp_state, VOMP_TIMEOUT_MEDIA, vomp_media_timeout);
+			vomp_state->instance->failures = 0;
+			if (vomp_state->initiated)
+				vomp_peer_call_result(vomp_state->remote_sid, 1);
 			ret=1;
 		}
+		release_channel(vomp_state);
 	}
 	return ret;
 }
@@ -306,7 +1180,7 @@ static int remote_pickup(char *cmd, int argc, char **argv, unsigned char *data,
 static int remote_hangup(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
 	int ret=0;
 	ast_log(LOG_WARNING, "remote_hangup\n");
-	struct vomp_channel *vomp_state=get_channel(argv[0]);
+	struct vomp_channel *vomp_state=get_channel(context, argv[0]);
 	if (vomp_state){
 		if (vomp_state->owner){
 			// ask asterisk to hangup the channel
@@ -314,96 +1188,219 @@ static int remote_hangup(char *cmd, int argc, char **argv, unsigned char *data,
 			ast_queue_hangup(vomp_state->owner);
 			ret=1;
 		}
+		release_channel(vomp_state);
 	}
 	return ret;
 }
 
+// returns 1 the first time we see this sequence number
+static int audio_sequence_new(struct vomp_channel *vomp_state, int sequence){
+	if (sequence<0)
+		return 1;
+	if (!vomp_state->rx_started){
+		vomp_state->rx_started = 1;
+		vomp_state->rx_first = vomp_state->rx_highest = sequence;
+		vomp_state->rx_window = 1;
+		return 1;
+	}
+	int delta = sequence - vomp_state->rx_highest;
+	if (delta > 0){
+		vomp_state->rx_window = delta >= 32 ? 1 : (vomp_state->rx_window << delta) | 1;
+		vomp_state->rx_highest = sequence;
+		return 1;
+	}
+	// too old for the jitter buffer to use anyway
+	if (-delta >= 32)
+		return 0;
+	unsigned bit = 1u << -delta;
+	if (vomp_state->rx_window & bit)
+		return 0;
+	vomp_state->rx_window |= bit;
+	return 1;
+}
+
+// frames that never arrived, and couldn't be rebuilt from redundant copies
+static int audio_lost(struct vomp_channel *vomp_state){
+	if (!vomp_state->rx_started)
+		return 0;
+	int lost = vomp_state->rx_highest - vomp_state->rx_first + 1 - vomp_state->rx_frames;
+	return lost > 0 ? lost : 0;
+}
+
+// pass one frame of audio to asterisk, called with a reference to the owner
+static int queue_audio(struct vomp_channel *vomp_state, int codec, int start_time, int sequence, unsigned char *data, int dataLen){
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.flags = AST_FRFLAG_HAS_TIMING_INFO,
+		.src = "vomp_call",
+		.data.ptr = data,
+		.datalen = dataLen,
+		.ts = start_time -1 +20,
+		.seqno = sequence,
+	};
+	
+	switch (codec){
+		case VOMP_CODEC_ULAW:
+			ast_format_set(&f.subclass.format, AST_FORMAT_ULAW, 0);
+			f.len = dataLen/8;
+			f.samples = dataLen;
+			break;
+		case VOMP_CODEC_ALAW:
+			ast_format_set(&f.subclass.format, AST_FORMAT_ALAW, 0);
+			f.len = dataLen/8;
+			f.samples = dataLen;
+			break;
+		case VOMP_CODEC_16SIGNED:
+			ast_format_set(&f.subclass.format, AST_FORMAT_SLINEAR, 0);
+			f.len = dataLen/16;
+			f.samples = dataLen / sizeof(int16_t);
+			break;
+		case VOMP_CODEC_GSM:
+			ast_format_set(&f.subclass.format, AST_FORMAT_GSM, 0);
+			f.len = dataLen/33*20;
+			f.samples = dataLen/33*160;
+			break;
+		default:
+			return 0;
+	}
+	
+	if (ast_format_cmp(&f.subclass.format, ast_channel_readformat(vomp_state->owner)) != AST_FORMAT_CMP_EQUAL){
+		// force audio transcoding paths to be rebuilt (I think...)
+		ast_set_read_format(vomp_state->owner, &f.subclass.format);
+	}
+	
+	ast_queue_frame(vomp_state->owner, &f);
+	vomp_state->rx_frames++;
+	return 1;
+}
+
+// split a bundle back into 20ms frames, skipping any we've already seen
+// other VoMP clients may number whole packets rather than each 20ms, so they are passed on as they are
+// returns the number of frames passed to asterisk
+static int receive_audio(struct vomp_channel *vomp_state, int codec, int start_time, int sequence, unsigned char *data, int dataLen){
+	int size = codec_frame_bytes(codec);
+	int i, count=0;
+	
+	if (!vomp_state->bundled || sequence<0 || !size || dataLen <= size || dataLen % size){
+		if (!audio_sequence_new(vomp_state, sequence))
+			return 0;
+		return queue_audio(vomp_state, codec, start_time, sequence, data, dataLen);
+	}
+	for (i=0;i<dataLen/size;i++){
+		if (audio_sequence_new(vomp_state, sequence+i))
+			count += queue_audio(vomp_state, codec, start_time + i*VOMP_FRAME_MS, sequence+i, data + i*size, size);
+	}
+	return count;
+}
+
+// RFC 2198 style, a 4 byte header for each earlier frame then a 1 byte header for the current one
+//   F(1) codec(7) time offset in ms(14) length(10)
+//   0(1) codec(7)
+// followed by the audio of each frame in the same order
+static int queue_redundant_audio(struct vomp_channel *vomp_state, int start_time, int sequence, unsigned char *data, int dataLen){
+	struct {
+		int codec, offset, len;
+	} blocks[VOMP_REDUNDANCY_MAX+1];
+	int count=0, i, pos=0;
+	
+	while (1){
+		if (pos >= dataLen || count > VOMP_REDUNDANCY_MAX)
+			return 0;
+		blocks[count].codec = data[pos] & 0x7f;
+		if (!(data[pos] & 0x80)){
+			pos++;
+			break;
+		}
+		if (pos + 4 > dataLen)
+			return 0;
+		blocks[count].offset = (data[pos+1]<<6) | (data[pos+2]>>2);
+		blocks[count].len = ((data[pos+2] & 3)<<8) | data[pos+3];
+		pos+=4;
+		count++;
+	}
+	
+	// earlier frames first, but only the ones we haven't seen
+	for (i=0;i<count;i++){
+		if (pos + blocks[i].len > dataLen)
+			return 0;
+		if (sequence>=0)
+			vomp_state->rx_recovered += receive_audio(vomp_state, blocks[i].codec, start_time - blocks[i].offset,
+				sequence - blocks[i].offset / VOMP_FRAME_MS, data + pos, blocks[i].len);
+		pos += blocks[i].len;
+	}
+	receive_audio(vomp_state, blocks[count].codec, start_time, sequence, data + pos, dataLen - pos);
+	return 1;
+}
+
+static void measure_jitter(struct vomp_channel *vomp_state, int start_time, int sequence){
+	if (sequence<0 || start_time<0)
+		return;
+	long long transit = vomp_state->last_audio - start_time;
+	if (vomp_state->rx_transit){
+		int d = transit - vomp_state->rx_transit;
+		if (d<0)
+			d=-d;
+		vomp_state->rx_jitter += d - ((vomp_state->rx_jitter + 8) >> 4);
+	}
+	vomp_state->rx_transit = transit;
+}
+
 static int remote_audio(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
 	int ret=0;
-	struct vomp_channel *vomp_state=get_channel(argv[0]);
+	struct vomp_channel *vomp_state=get_channel(context, argv[0]);
 	if (vomp_state){
+		vomp_state->last_audio = gettime_ms();
+		if (vomp_simulate_loss > 0 && ast_random() % 100 < vomp_simulate_loss){
+			// pretend the mesh lost this one
+			vomp_state->rx_discarded++;
+			release_channel(vomp_state);
+			return 1;
+		}
 		if (vomp_state->owner){
 			int codec = strtol(argv[1], NULL, 10);
 			int start_time = strtol(argv[2], NULL, 10);
 			int sequence = strtol(argv[3], NULL, 10);
 			
-			struct ast_frame f = {
-				.frametype = AST_FRAME_VOICE,
-				.flags = AST_FRFLAG_HAS_TIMING_INFO,
-				.src = "vomp_call",
-				.data.ptr = data,
-				.datalen = dataLen,
-				.ts = start_time -1 +20,
-				.seqno = sequence,
-			};
-			
-			switch (codec){
-				case VOMP_CODEC_ULAW:
-					ast_format_set(&f.subclass.format, AST_FORMAT_ULAW, 0);
-					f.len = dataLen/8;
-					f.samples = dataLen;
-					break;
-				case VOMP_CODEC_ALAW:
-					ast_format_set(&f.subclass.format, AST_FORMAT_ALAW, 0);
-					f.len = dataLen/8;
-					f.samples = dataLen;
-					break;
-				case VOMP_CODEC_16SIGNED:
-					ast_format_set(&f.subclass.format, AST_FORMAT_SLINEAR16, 0);
-					f.len = dataLen/16;
-					f.samples = dataLen / sizeof(int16_t);
-					break;
-				case VOMP_CODEC_GSM:
-					ast_format_set(&f.subclass.format, AST_FORMAT_GSM, 0);
-					break;
-				default:
-					return 0;
-			}
-			
-			if (ast_format_cmp(&f.subclass.format, ast_channel_readformat(vomp_state->owner)) != AST_FORMAT_CMP_EQUAL){
-				// force audio transcoding paths to be rebuilt (I think...)
-				ast_set_read_format(vomp_state->owner, &f.subclass.format);
+			measure_jitter(vomp_state, start_time, sequence);
+			if (codec == VOMP_CODEC_REDUNDANT)
+				ret = queue_redundant_audio(vomp_state, start_time, sequence, data, dataLen);
+			else if (codec_bit(codec)){
+				receive_audio(vomp_state, codec, start_time, sequence, data, dataLen);
+				ret = 1;
 			}
-			
-			ast_queue_frame(vomp_state->owner, &f);
-			ret=1;
 		}
+		release_channel(vomp_state);
 	}
 	return ret;
 }
 
+// CODECS [token] [codec] ...
 static int remote_codecs(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
-	struct vomp_channel *vomp_state=get_channel(argv[0]);
-	if (vomp_state){
-		int i;
-		struct ast_format_cap *cap = ast_format_cap_alloc(); // TODO AST_FORMAT_CAP_FLAG_DEFAULT
-		if (cap){
-			struct ast_format tmpfmt;
-			for (i=1;i<argc;i++){
-				int codec = atoi(argv[i]);
-				switch(codec){
-					case VOMP_CODEC_ULAW:
-						ast_format_set(&tmpfmt, AST_FORMAT_ULAW, 0);
-						break;
-					case VOMP_CODEC_ALAW:
-						ast_format_set(&tmpfmt, AST_FORMAT_ALAW, 0);
-						break;
-					case VOMP_CODEC_16SIGNED:
-						ast_format_set(&tmpfmt, AST_FORMAT_SLINEAR16, 0);
-						break;
-					case VOMP_CODEC_GSM:
-						ast_format_set(&tmpfmt, AST_FORMAT_GSM, 0);
-						break;
-					default:
-						continue;
-				}
-				ast_format_cap_add(cap, &tmpfmt);
-			}
-			ast_channel_nativeformats_set(vomp_state->owner, cap);
-			ast_best_codec(cap, &tmpfmt);
-			ast_set_write_format(vomp_state->owner, &tmpfmt);
-		}
+	struct vomp_instance *instance = context;
+	int i, codecs=0, redundant=0, bundled=0;
+	if (argc<1)
+		return 1;
+	for (i=1;i<argc;i++){
+		int codec = atoi(argv[i]);
+		if (codec == VOMP_CODEC_REDUNDANT)
+			redundant = 1;
+		else if (codec == VOMP_CODEC_BUNDLED)
+			bundled = 1;
+		codecs |= codec_bit(codec);
+	}
+	
+	int session_id = strtol(argv[0], NULL, 16);
+	struct vomp_channel *vomp_state=find_channel(instance, session_id);
+	if (!vomp_state){
+		// hold on to them until CALLFROM
+		instance->pending_session = session_id;
+		instance->pending_codecs = codecs;
+		instance->pending_redundant = redundant;
+		instance->pending_bundled = bundled;
+		return 1;
 	}
+	set_codecs(vomp_state, codecs, redundant, bundled);
+	release_channel(vomp_state);
 	return 1;
 }
 
@@ -411,13 +1408,18 @@ static int remote_codecs(char *cmd, int argc, char **argv, unsigned char *data,
 static int remote_ringing(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
 	int ret=0;
 	ast_log(LOG_WARNING, "remote_ringing\n");
-	struct vomp_channel *vomp_state=get_channel(argv[0]);
+	struct vomp_channel *vomp_state=get_channel(context, argv[0]);
 	if (vomp_state){
 		if (vomp_state->owner){
 			ast_indicate(vomp_state->owner, AST_CONTROL_RINGING);
 			ast_queue_control(vomp_state->owner, AST_CONTROL_RINGING);
+			set_timeout(vomp_state, VOMP_TIMEOUT_RINGING, vomp_ring_timeout);
+			vomp_state->instance->failures = 0;
+			if (vomp_state->initiated)
+				vomp_peer_call_result(vomp_state->remote_sid, 1);
 			ret=1;
 		}
+		release_channel(vomp_state);
 	}
 	return ret;
 }
@@ -427,45 +1429,322 @@ static int remote_noop(char *cmd, int argc, char **argv, unsigned char *data, in
 	return 1;
 }
 
+// KEEPALIVE [token]
+static int remote_keepalive(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+	if (argc<1)
+		return 1;
+	// finding the session is enough to mark it as alive
+	struct vomp_channel *vomp_state = find_channel(context, strtol(argv[0], NULL, 16));
+	if (vomp_state)
+		release_channel(vomp_state);
+	return 1;
+}
+
+// NEWPEER [sid], servald has a route to this peer
+static int remote_newpeer(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+	struct vomp_instance *instance = context;
+	if (argc>=1)
+		vomp_peer_reachable(argv[0], instance->index, 1);
+	return 1;
+}
+
+// OLDPEER [sid], servald has lost its route to this peer
+static int remote_oldpeer(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+	struct vomp_instance *instance = context;
+	if (argc>=1)
+		vomp_peer_reachable(argv[0], instance->index, 0);
+	return 1;
+}
+
+// CALLSTATUS [token] [remote token] [local state] [remote state] ...
+// used to reattach our sessions after reconnecting to servald
+static int remote_callstatus(char *cmd, int argc, char **argv, unsigned char *data, int dataLen, void *context){
+	struct vomp_instance *instance = context;
+	if (argc<4)
+		return 0;
+	int session_id = strtol(argv[0], NULL, 16);
+	int local_state = strtol(argv[2], NULL, 10);
+	int remote_state = strtol(argv[3], NULL, 10);
+	int ended = local_state >= VOMP_STATE_CALLENDED || remote_state >= VOMP_STATE_CALLENDED;
+	
+	struct vomp_channel *vomp_state = find_channel(instance, session_id);
+	if (vomp_state){
+		struct ast_channel *owner = NULL;
+		ao2_lock(vomp_state);
+		if (ended && vomp_state->owner)
+			owner = ast_channel_ref(vomp_state->owner);
+		ao2_unlock(vomp_state);
+		if (owner){
+			ast_queue_hangup(owner);
+			ast_channel_unref(owner);
+		}
+		release_channel(vomp_state);
+	}else if (!ended && orphan_take(instance, session_id)){
+		// a call that outlived its asterisk channel while we were disconnected
+		// other monitor clients of this servald have sessions too, so leave any we didn't own
+		ast_log(LOG_WARNING, "Hanging up orphaned session %s/%06x\n", instance->name, session_id);
+		send_hangup(instance, session_id);
+	}
+	return 1;
+}
+
+// any session servald hasn't mentioned since we reconnected is gone
+static void resync_expired(struct vomp_timer *timer){
+	struct vomp_instance *instance = timer->context;
+	struct ao2_iterator i;
+	struct vomp_channel *vomp_state;
+	int generation = instance->generation;
+	int dropped=0;
+	
+	instance->resyncing = 0;
+	// servald no longer has any orphans it hasn't mentioned
+	ast_mutex_lock(&instance->write_lock);
+	instance->orphan_count = 0;
+	ast_mutex_unlock(&instance->write_lock);
+	
+	i = ao2_iterator_init(channels, 0);
+	while ((vomp_state = ao2_iterator_next(&i))){
+		struct ast_channel *owner = NULL;
+		ao2_lock(vomp_state);
+		if (vomp_state->instance == instance
+		    && vomp_state->monitor_generation != generation && vomp_state->owner)
+			owner = ast_channel_ref(vomp_state->owner);
+		ao2_unlock(vomp_state);
+		if (owner){
+			ast_queue_hangup_with_cause(owner, AST_CAUSE_NETWORK_OUT_OF_ORDER);
+			ast_channel_unref(owner);
+			dropped++;
+		}
+		release_channel(vomp_state);
+	}
+	ao2_iterator_destroy(&i);
+	ast_log(LOG_WARNING, "Monitor resync of %s complete, %d of %d sessions lost\n",
+		instance->name, dropped, instance->sessions);
+}
+
+static int monitor_connect(struct vomp_instance *instance){
+	vomp_path_lock(instance->path);
+	int fd = monitor_client_open(&instance->state);
+	vomp_path_unlock();
+	if (fd<0)
+		return -1;
+	
+	ast_log(LOG_WARNING, "sending monitor vomp command to %s\n", instance->name);
+	if (vomp_redundancy > 0)
+		monitor_client_writeline(fd, "monitor vomp %d %d %d %d %d %d\n",
+				 VOMP_CODEC_16SIGNED, VOMP_CODEC_ULAW, VOMP_CODEC_ALAW, VOMP_CODEC_GSM, VOMP_CODEC_BUNDLED, VOMP_CODEC_REDUNDANT);
+	else
+		monitor_client_writeline(fd, "monitor vomp %d %d %d %d %d\n",
+				 VOMP_CODEC_16SIGNED, VOMP_CODEC_ULAW, VOMP_CODEC_ALAW, VOMP_CODEC_GSM, VOMP_CODEC_BUNDLED);
+	
+	if (monitor_resolve_numbers)
+		monitor_client_writeline(fd, "monitor dnahelper\n");
+	
+	// servald will tell us about every reachable peer, then any changes
+	monitor_client_writeline(fd, "monitor peers\n");
+	
+	instance->generation++;
+	instance->fd = fd;
+	
+	// give servald a chance to tell us about any sessions that survived
+	if ((instance->sessions || instance->orphan_count) && vomp_resync_timeout > 0){
+		instance->resyncing = 1;
+		vomp_timer_set(&instance->resync_timer, vomp_resync_timeout);
+	}
+	return 0;
+}
+
+static void monitor_disconnect(struct vomp_instance *instance){
+	int fd = instance->fd;
+	struct vomp_channel *pending;
+	ast_log(LOG_WARNING, "closing monitor connection to %s\n", instance->name);
+	ast_mutex_lock(&instance->write_lock);
+	instance->fd=-1;
+	ast_mutex_unlock(&instance->write_lock);
+	monitor_client_close(fd, instance->state);
+	instance->state = NULL;
+	instance->lookup_count = 0;
+	vomp_peer_instance_lost(instance->index);
+	
+	// servald never saw the outgoing calls that we were waiting on
+	ast_mutex_lock(&instance->dial_lock);
+	pending = instance->dial_head;
+	instance->dial_head = instance->dial_tail = NULL;
+	ast_mutex_unlock(&instance->dial_lock);
+	
+	while (pending){
+		struct vomp_channel *vomp_state = pending;
+		struct ast_channel *owner = NULL;
+		pending = vomp_state->next_dial;
+		vomp_state->next_dial = NULL;
+		
+		ao2_lock(vomp_state);
+		if (!vomp_state->abandoned && vomp_state->owner)
+			owner = ast_channel_ref(vomp_state->owner);
+		ao2_unlock(vomp_state);
+		if (owner){
+			ast_queue_hangup_with_cause(owner, AST_CAUSE_NETWORK_OUT_OF_ORDER);
+			ast_channel_unref(owner);
+		}
+		release_channel(vomp_state);
+	}
+}
+
+// connect any instance that is due for another attempt
+// returns the number of milliseconds until the next attempt, or -1
+static int monitor_reconnect(void){
+	long long now = gettime_ms();
+	int i, timeout = -1;
+	
+	for (i=0;i<instance_count;i++){
+		struct vomp_instance *instance = instances[i];
+		if (instance->fd>=0)
+			continue;
+		if (now >= instance->next_attempt){
+			if (monitor_connect(instance)==0){
+				ast_log(LOG_WARNING, "reading monitor events from %s\n", instance->name);
+				instance->backoff = 0;
+				continue;
+			}
+			if (!instance->backoff)
+				ast_log(LOG_ERROR, "Failed to open monitor connection to %s, please start servald\n", instance->name);
+			instance->backoff = instance->backoff ? instance->backoff*2 : RECONNECT_MIN_MS;
+			if (instance->backoff > RECONNECT_MAX_MS)
+				instance->backoff = RECONNECT_MAX_MS;
+			instance->next_attempt = now + instance->backoff;
+		}
+		if (timeout<0 || instance->next_attempt - now < timeout)
+			timeout = instance->next_attempt - now;
+	}
+	return timeout;
+}
+
 // thread function for the monitor client
-// reads and processes incoming messages
+// reads and processes incoming messages from every instance, reconnecting whenever servald goes away
 static void *vomp_monitor(void *ignored){
-	struct monitor_state *state;
+	struct pollfd fds[VOMP_MAX_INSTANCES+1];
+	struct vomp_instance *polled[VOMP_MAX_INSTANCES];
+	int i;
 	
 	while (1){
-		pthread_testcancel();
-		ast_log(LOG_WARNING, "opening monitor connection\n");
-		monitor_client_fd = monitor_client_open(&state);
+		int timeout = monitor_reconnect();
+		int nfds = 1;
 		
-		if (monitor_client_fd<0){
-			ast_log(LOG_ERROR, "Failed to open monitor connection, please start servald\n");
-			sleep(10);
-			continue;
+		fds[0].fd = monitor_wake[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		for (i=0;i<instance_count;i++){
+			if (instances[i]->fd<0)
+				continue;
+			polled[nfds-1] = instances[i];
+			fds[nfds].fd = instances[i]->fd;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
 		}
 		
-		ast_log(LOG_WARNING, "sending monitor vomp command\n");
-		monitor_client_writeline(monitor_client_fd, "monitor vomp %d %d %d %d\n",
-					 VOMP_CODEC_16SIGNED, VOMP_CODEC_ULAW, VOMP_CODEC_ALAW, VOMP_CODEC_GSM);
-	  
-		if (monitor_resolve_numbers)
-			monitor_client_writeline(monitor_client_fd, "monitor dnahelper\n");
-	  
-		ast_log(LOG_WARNING, "reading monitor events\n");
-		for(;;){
-			pthread_testcancel();
-			if (monitor_client_read(monitor_client_fd, state, monitor_handlers, 
-						sizeof(monitor_handlers)/sizeof(struct monitor_command_handler))<0){
-				break;
-			}
+		if (poll(fds, nfds, timeout)<0){
+			if (errno==EINTR)
+				continue;
+			ast_log(LOG_ERROR, "poll failed: %s\n", strerror(errno));
+			break;
 		}
-		ast_log(LOG_WARNING, "closing monitor connection\n");
-		monitor_client_close(monitor_client_fd, state);
-		monitor_client_fd=-1;
-		sleep(1);
+		
+		// unload_module wants us to stop
+		if (fds[0].revents)
+			break;
+		
+		for (i=1;i<nfds;i++){
+			struct vomp_instance *instance = polled[i-1];
+			if (!fds[i].revents)
+				continue;
+			if (monitor_client_read(instance->fd, instance->state, instance->handlers, MONITOR_HANDLER_COUNT)<0){
+				monitor_disconnect(instance);
+				// try again straight away, servald may have just restarted
+				instance->next_attempt = 0;
+			}else
+				lookup_flush(instance);
+		}
+	}
+	for (i=0;i<instance_count;i++){
+		if (instances[i]->fd>=0)
+			monitor_disconnect(instances[i]);
 	}
 	return NULL;
 }
 
+// pick the connected instance with the lowest load relative to its weight,
+// avoiding instances that keep failing to connect calls, or have no route to the peer, while another is healthy
+// instances without the capacity for another call of this bandwidth are skipped, setting *congested
+static struct vomp_instance *choose_instance(const char *sid, int kbps, int *congested){
+	struct vomp_instance *best = NULL;
+	long best_score = 0;
+	int i;
+	
+	*congested = 0;
+	for (i=0;i<instance_count;i++){
+		struct vomp_instance *instance = instances[i];
+		if (instance->fd<0)
+			continue;
+		const char *limit = instance_admission_check(instance, kbps);
+		if (limit){
+			ast_debug(1, "%s is at its %s limit\n", instance->name, limit);
+			*congested = 1;
+			continue;
+		}
+		long score = (instance->sessions + 1) * 1000L / instance->weight;
+		if (instance->failures >= INSTANCE_FAILURE_LIMIT)
+			score += 1000000L;
+		if (vomp_peer_reachable_via(sid, instance->index)==0)
+			score += 2000000L;
+		if (!best || score < best_score){
+			best = instance;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+int vomp_add_instance(const char *name, const char *path, int weight){
+	if (instance_count >= VOMP_MAX_INSTANCES){
+		ast_log(LOG_ERROR, "Too many servald instances, ignoring %s\n", name);
+		return -1;
+	}
+	struct vomp_instance *instance = ast_calloc(1, sizeof(struct vomp_instance));
+	if (!instance)
+		return -1;
+	
+	ast_copy_string(instance->name, name, sizeof(instance->name));
+	ast_copy_string(instance->path, path, sizeof(instance->path));
+	instance->index = instance_count;
+	instance->weight = weight > 0 ? weight : 1;
+	instance->fd = -1;
+	memcpy(instance->handlers, monitor_handlers, sizeof(monitor_handlers));
+	unsigned i;
+	for (i=0;i<MONITOR_HANDLER_COUNT;i++)
+		instance->handlers[i].context = instance;
+	instance->resync_timer.callback = resync_expired;
+	instance->resync_timer.context = instance;
+	ast_mutex_init(&instance->dial_lock);
+	ast_mutex_init(&instance->write_lock);
+	
+	instances[instance_count++] = instance;
+	ast_log(LOG_WARNING, "Using servald instance %s at %s\n", name, path);
+	return 0;
+}
+
+static void free_instances(void){
+	int i;
+	for (i=0;i<instance_count;i++){
+		vomp_timer_cancel(&instances[i]->resync_timer);
+		ast_mutex_destroy(&instances[i]->dial_lock);
+		ast_mutex_destroy(&instances[i]->write_lock);
+		ast_free(instances[i]);
+		instances[i] = NULL;
+	}
+	instance_count = 0;
+}
+
 
 
 // functions for handling incoming asterisk events
@@ -476,7 +1755,7 @@ static struct ast_channel  *vomp_request(const char *type, struct ast_format_cap
 	// assume addr = servald subscriber id (sid)
 	char sid[64], did[64];
 	int i=0;
-	for (;i<sizeof(sid) && addr[i] && addr[i]!='/';i++)
+	for (;i<sizeof(sid)-1 && addr[i] && addr[i]!='/';i++)
 		sid[i]=addr[i];
 	
 	sid[i]=0;
@@ -485,7 +1764,7 @@ static struct ast_channel  *vomp_request(const char *type, struct ast_format_cap
 	addr+=i;
 	i=0;
 	if (*addr++){
-		for (;i<sizeof(did) && addr[i];i++){
+		for (;i<sizeof(did)-1 && addr[i];i++){
 			if (addr[i]=='/'){
 				// start copying again from the beginning
 				addr+=i+1;
@@ -498,7 +1777,51 @@ static struct ast_channel  *vomp_request(const char *type, struct ast_format_cap
 	did[i]=0;
 	
 	ast_log(LOG_WARNING, "vomp_request %s/%s\n", type, sid);
-	struct vomp_channel *vomp_state=new_vomp_channel();
+	if (vomp_peer_state(sid) == AST_DEVICE_UNAVAILABLE){
+		// don't make the dialplan wait for a call to a peer we know we can't reach
+		ast_log(LOG_WARNING, "%s is unreachable\n", sid);
+		*cause = AST_CAUSE_NO_ROUTE_DESTINATION;
+		return NULL;
+	}
+	// asterisk will transcode to whichever of these codecs the far end chooses
+	int offered = cap ? codec_mask(cap) : CODEC_MASK_ALL;
+	if (!offered){
+		ast_log(LOG_WARNING, "No codecs in common with %s\n", sid);
+		*cause = AST_CAUSE_BEARERCAPABILITY_NOTAVAIL;
+		return NULL;
+	}
+	
+	// refuse new calls cleanly rather than degrading the calls we already have
+	const char *limit = admission_check(sid);
+	if (limit){
+		ast_log(LOG_WARNING, "Refusing call to %s, %s reached\n", sid, limit);
+		*cause = AST_CAUSE_CONGESTION;
+		return NULL;
+	}
+	
+	int congested;
+	struct vomp_instance *instance = choose_instance(sid, codec_kbps[offered], &congested);
+	if (!instance && congested){
+		ast_log(LOG_WARNING, "Refusing call to %s, no servald instance has capacity\n", sid);
+		*cause = AST_CAUSE_CONGESTION;
+		return NULL;
+	}
+	if (!instance){
+		// fail fast rather than waiting for a call that servald will never see
+		ast_log(LOG_WARNING, "Not connected to servald\n");
+		*cause = AST_CAUSE_NETWORK_OUT_OF_ORDER;
+		return NULL;
+	}
+	struct vomp_channel *vomp_state=new_vomp_channel(instance);
+	if (!vomp_state){
+		*cause = AST_CAUSE_SWITCH_CONGESTION;
+		return NULL;
+	}
+	ast_copy_string(vomp_state->remote_sid, sid, sizeof(vomp_state->remote_sid));
+	vomp_peer_call_count(vomp_state->remote_sid, +1);
+	vomp_state->offered_codecs = offered;
+	vomp_state->codecs = offered;
+	reserve_bandwidth(vomp_state, codec_kbps[offered]);
 	
 	// TODO?
 	//struct ast_callid *callid = ast_read_threadstorage_callid();
@@ -507,10 +1830,19 @@ static struct ast_channel  *vomp_request(const char *type, struct ast_format_cap
 	
 	vomp_state->initiated=1;
 	struct ast_channel *ast = new_channel(vomp_state, AST_STATE_DOWN, NULL, NULL);
+	if (!ast){
+		ast_log(LOG_WARNING, "Unable to allocate channel for call to %s\n", sid);
+		// nothing else has seen the session, so this returns it to the pool
+		release_channel(vomp_state);
+		*cause = AST_CAUSE_SWITCH_CONGESTION;
+		return NULL;
+	}
 	
-	dialed_call = vomp_state;
+	dial_queue_push(vomp_state);
 	
-	send_call(sid,"1",did);
+	// if servald never gets as far as ringing the other end, give up
+	set_timeout(vomp_state, VOMP_TIMEOUT_SETUP, vomp_setup_timeout);
+	send_call(instance, sid, "1", did);
 	
 	return ast;
 }
@@ -519,14 +1851,19 @@ static int vomp_hangup(struct ast_channel *ast){
 	ast_log(LOG_WARNING, "vomp_hangup %s\n", ast_channel_name(ast));
 	
 	struct vomp_channel *vomp_state = ast_channel_tech_pvt(ast);
+	clear_timeout(vomp_state);
+	
 	ao2_lock(vomp_state);
 	
-	send_hangup(vomp_state->session_id);
-	ao2_unlink(channels, vomp_state);
+	int session_id = dial_queue_abandon(vomp_state);
+	if (session_id)
+		send_hangup(vomp_state->instance, session_id);
 	ast_channel_tech_set(ast, NULL);
 	ast_channel_tech_pvt_set(ast, NULL);
 	vomp_state->owner = NULL;
 	ao2_unlock(vomp_state);
+	// release the reference held by the channel since new_vomp_channel
+	release_channel(vomp_state);
 	return 0;
 }
 
@@ -552,7 +1889,7 @@ static int vomp_indicate(struct ast_channel *ast, int ind, const void *data, siz
 			
 		case AST_CONTROL_BUSY:
 		case AST_CONTROL_CONGESTION:
-			send_hangup(vomp_state->session_id);
+			send_hangup(vomp_state->instance, vomp_state->session_id);
 			break;
 			
 		default:
@@ -561,10 +1898,23 @@ static int vomp_indicate(struct ast_channel *ast, int ind, const void *data, siz
 	return 0;
 }
 
+// device state of VOMP/<sid>, from the cached reachability of the peer
+static int vomp_devicestate(const char *data){
+	return vomp_peer_state(data);
+}
+
 static int vomp_call(struct ast_channel *ast, const char *dest, int timeout){
 	// NOOP, as we have already started the call in vomp_request
 	ast_log(LOG_WARNING, "vomp_call %s %s\n", ast_channel_name(ast), dest);
 	
+	// honour the dialer's timeout in place of the configured default
+	if (timeout > 0){
+		struct vomp_channel *vomp_state = ast_channel_tech_pvt(ast);
+		ao2_lock(vomp_state);
+		if (vomp_state->timeout_reason == VOMP_TIMEOUT_SETUP)
+			set_timeout(vomp_state, VOMP_TIMEOUT_SETUP, timeout);
+		ao2_unlock(vomp_state);
+	}
 	return 0;
 }
 
@@ -575,6 +1925,7 @@ static int vomp_answer(struct ast_channel *ast){
 	
 	vomp_state->call_start = gettime_ms();
 	ast_setstate(ast, AST_STATE_UP);
+	set_timeout(vomp_state, VOMP_TIMEOUT_MEDIA, vomp_media_timeout);
 	send_pickup(vomp_state);
 	return 0;
 }
@@ -611,12 +1962,54 @@ static int vomp_write(struct ast_channel *ast, struct ast_frame *frame){
 					return 0;
 			}
 			
-			if (frame->flags & AST_FRFLAG_HAS_TIMING_INFO){
-				audio_time=frame->ts;
-				audio_sequence=frame->seqno;
+			vomp_state->tx_frames++;
+			
+			// audio is numbered by our own clock, one sequence number for every 20ms,
+			// asterisk counts frames of any length, which a far end splitting bundles would misread
+			int size = codec_frame_bytes(audio_codec);
+			int frames = size && frame->datalen % size == 0 ? frame->datalen / size : 0;
+			
+			if (!frames){
+				// not whole 20ms frames, eg 10 or 30ms, sent on their own but still on our clock
+				// every codec we carry is sampled at 8kHz
+				int ms = frame->samples / 8;
+				flush_audio(vomp_state);
+				if (ms > 0){
+					audio_time = vomp_state->tx_time;
+					audio_sequence = vomp_state->tx_sequence;
+					vomp_state->tx_time += ms;
+					// the far end drops repeated sequence numbers, so never less than one
+					vomp_state->tx_sequence += (ms + VOMP_FRAME_MS - 1) / VOMP_FRAME_MS;
+				}
+				vomp_state->tx_ptime = ms;
+				send_audio(vomp_state, frame->data.ptr, frame->datalen, audio_codec, audio_time, audio_sequence);
+				break;
 			}
 			
-			send_audio(vomp_state, frame->data.ptr, frame->datalen, audio_codec, audio_time, audio_sequence);
+			if (vomp_state->tx_bundle_len && (vomp_state->tx_bundle_codec != audio_codec
+					|| vomp_state->tx_bundle_len + frame->datalen > sizeof(vomp_state->tx_bundle)))
+				flush_audio(vomp_state);
+			
+			audio_time = vomp_state->tx_time;
+			audio_sequence = vomp_state->tx_sequence;
+			vomp_state->tx_time += frames * VOMP_FRAME_MS;
+			vomp_state->tx_sequence += frames;
+			
+			// only a far end that splits bundles can take more audio than asterisk gave us
+			if (!vomp_state->bundled || frame->datalen > sizeof(vomp_state->tx_bundle)){
+				send_frames(vomp_state, frame->data.ptr, frame->datalen, audio_codec, audio_time, audio_sequence, frames);
+				break;
+			}
+			if (!vomp_state->tx_bundle_len){
+				vomp_state->tx_bundle_codec = audio_codec;
+				vomp_state->tx_bundle_time = audio_time;
+				vomp_state->tx_bundle_sequence = audio_sequence;
+			}
+			memcpy(vomp_state->tx_bundle + vomp_state->tx_bundle_len, frame->data.ptr, frame->datalen);
+			vomp_state->tx_bundle_len += frame->datalen;
+			vomp_state->tx_bundle_frames += frames;
+			if (vomp_state->tx_bundle_frames * VOMP_FRAME_MS >= session_ptime(vomp_state, audio_codec))
+				flush_audio(vomp_state);
 		break;}
 		default:
 			break;
@@ -626,40 +2019,167 @@ static int vomp_write(struct ast_channel *ast, struct ast_frame *frame){
 
 static int vomp_hash(const void *obj, const int flags){
 	const struct vomp_channel *vomp_state = obj;
-	return vomp_state->session_id;
+	return vomp_state->session_id ^ (vomp_state->instance->index << 24);
 }
 
 static int vomp_compare(void *obj, void *arg, int flags){
 	struct vomp_channel *obj1 = obj;
 	struct vomp_channel *obj2 = arg;
-	return obj1->session_id==obj2->session_id ? CMP_MATCH | CMP_STOP : 0;
+	return obj1->session_id==obj2->session_id && obj1->instance==obj2->instance ? CMP_MATCH | CMP_STOP : 0;
 }
 
+static int cancel_timeout_cb(void *obj, void *arg, int flags){
+	clear_timeout(obj);
+	return 0;
+}
+
+static char *vomp_show_instances(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a){
+	int i;
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "vomp show instances";
+			e->usage = 
+			"Usage: vomp show instances\n"
+			"       List the servald instances used by the VoMP channel driver\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+	
+	ast_cli(a->fd, "%-16s %-12s %6s %8s %8s %6s %8s %8s %8s  %s\n", "Name", "State", "Weight", "Sessions", "Failures", "Kbps", "Rejected",
+		"Lookups", "Repeats", "Path");
+	for (i=0;i<instance_count;i++){
+		struct vomp_instance *instance = instances[i];
+		ast_cli(a->fd, "%-16s %-12s %6d %8d %8d %6d %8d %8d %8d  %s\n", instance->name,
+			instance->fd<0 ? "Disconnected" : instance->resyncing ? "Resyncing" : "Connected",
+			instance->weight, instance->sessions, instance->failures, instance->kbps, instance->rejected,
+			instance->lookups, instance->lookup_duplicates, instance->path);
+	}
+	return CLI_SUCCESS;
+}
+
+static char *vomp_show_memory(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a){
+	int peer_count, peer_size;
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "vomp show memory";
+			e->usage = 
+			"Usage: vomp show memory\n"
+			"       Show the memory held by the VoMP channel driver\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+	
+	vomp_peers_usage(&peer_count, &peer_size);
+	
+	ast_cli(a->fd, "Session size:     %d bytes\n", (int)sizeof(struct vomp_channel));
+	if (session_pool)
+		ast_cli(a->fd, "Session pool:     %d of %d in use, %d bytes preallocated\n",
+			pool_in_use, pool_size, pool_size * (int)sizeof(struct vomp_channel));
+	else
+		ast_cli(a->fd, "Session pool:     none, %d sessions allocated on demand\n",
+			ao2_container_count(channels));
+	ast_cli(a->fd, "Instances:        %d x %d bytes\n", instance_count, (int)sizeof(struct vomp_instance));
+	ast_cli(a->fd, "Peers:            %d x %d bytes%s\n", peer_count, peer_size,
+		vomp_max_peers > 0 ? "" : ", unbounded");
+	ast_cli(a->fd, "Capability sets:  %d, shared by all sessions\n", CODEC_MASK_ALL+1);
+	ast_cli(a->fd, "Driver memory per supported call: %d bytes, plus the asterisk channel and its jitter buffer\n",
+		(int)sizeof(struct vomp_channel));
+	return CLI_SUCCESS;
+}
+
+static char *vomp_show_calls(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a){
+	struct ao2_iterator i;
+	struct vomp_channel *vomp_state;
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "vomp show calls";
+			e->usage = 
+			"Usage: vomp show calls\n"
+			"       List VoMP sessions and their audio loss\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+	
+	ast_cli(a->fd, "%-6s %-16s %-16s %-8s %3s %5s %6s %7s %7s %6s %9s %9s\n", "Id", "Instance", "Peer", "Codec", "Red",
+		"Ptime", "Jitter", "Sent", "Recv", "Lost", "Recovered", "Discarded");
+	i = ao2_iterator_init(channels, 0);
+	while ((vomp_state = ao2_iterator_next(&i))){
+		ast_cli(a->fd, "%06x %-16s %-16.16s %-8s %3s %5d %6d %7d %7d %6d %9d %9d\n", vomp_state->session_id,
+			vomp_state->instance->name, vomp_state->remote_sid, ast_getformatname(&codec_best[vomp_state->codecs]),
+			vomp_state->redundant ? "yes" : "no", vomp_state->tx_ptime, vomp_state->rx_jitter / 16,
+			vomp_state->tx_frames, vomp_state->rx_frames,
+			audio_lost(vomp_state), vomp_state->rx_recovered, vomp_state->rx_discarded);
+		release_channel(vomp_state);
+	}
+	ao2_iterator_destroy(&i);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_vomp[] = {
+	AST_CLI_DEFINE(vomp_show_instances, "List servald instances"),
+	AST_CLI_DEFINE(vomp_show_calls, "List VoMP sessions"),
+	AST_CLI_DEFINE(vomp_show_memory, "Show VoMP memory use"),
+};
+
 // module load / unload
 int vomp_register_channel(void){
 	ast_log(LOG_WARNING, "Registering Serval channel driver\n");
-	vomp_tech.capabilities = ast_format_cap_alloc();// TODO AST_FORMAT_CAP_FLAG_DEFAULT
-	if (!vomp_tech.capabilities)
-		return AST_MODULE_LOAD_FAILURE;
+	if (!instance_count){
+		ast_log(LOG_ERROR, "No servald instances configured\n");
+		return AST_MODULE_LOAD_DECLINE;
+	}
 	
-	struct ast_format tmpfmt;
+	if (codec_caps_init()){
+		codec_caps_destroy();
+		return AST_MODULE_LOAD_FAILURE;
+	}
 	
-	ast_format_cap_add(vomp_tech.capabilities, ast_format_set(&tmpfmt, AST_FORMAT_ULAW, 0));
-	ast_format_cap_add(vomp_tech.capabilities, ast_format_set(&tmpfmt, AST_FORMAT_ALAW, 0));
-	ast_format_cap_add(vomp_tech.capabilities, ast_format_set(&tmpfmt, AST_FORMAT_SLINEAR16, 0));
-	ast_format_cap_add(vomp_tech.capabilities, ast_format_set(&tmpfmt, AST_FORMAT_GSM, 0));
+	if (vomp_max_calls > 0){
+		if (session_pool_init(vomp_max_calls)){
+			ast_log(LOG_ERROR, "Unable to preallocate %d sessions\n", vomp_max_calls);
+			session_pool_destroy();
+			codec_caps_destroy();
+			return AST_MODULE_LOAD_FAILURE;
+		}
+		ast_log(LOG_WARNING, "Preallocated %d sessions\n", vomp_max_calls);
+	}
+	vomp_tech.capabilities = codec_caps[CODEC_MASK_ALL];
 	
 	if (ast_channel_register(&vomp_tech)) {
-		ao2_cleanup(vomp_tech.capabilities);
+		session_pool_destroy();
+		codec_caps_destroy();
 		ast_log(LOG_ERROR, "Unable to register channel class %s\n", vomp_tech.type);
 		return AST_MODULE_LOAD_FAILURE;
 	}
 	
-	channels=ao2_container_alloc(1, vomp_hash, vomp_compare);
+	channels=ao2_container_alloc(CHANNEL_BUCKETS, vomp_hash, vomp_compare);
+	
+	if (vomp_timer_start()){
+		ast_channel_unregister(&vomp_tech);
+		session_pool_destroy();
+		codec_caps_destroy();
+		return AST_MODULE_LOAD_FAILURE;
+	}
+	
+	if (vomp_peers_init())
+		ast_log(LOG_ERROR, "Unable to track peer reachability\n");
+	
+	if (pipe(monitor_wake)){
+		ast_log(LOG_ERROR, "Unable to create pipe: %s\n", strerror(errno));
+		monitor_wake[0] = monitor_wake[1] = -1;
+	}
 	
 	if (ast_pthread_create_background(&thread, NULL, vomp_monitor, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start monitor thread\n");
+		thread = AST_PTHREADT_NULL;
 	}
 	
+	ast_cli_register_multiple(cli_vomp, ARRAY_LEN(cli_vomp));
+	channel_registered = 1;
+	
 	ast_log(LOG_WARNING, "Done\n");
 	return 0;
 }
@@ -667,17 +2187,38 @@ int vomp_register_channel(void){
 int vomp_unregister_channel(void){
 	ast_log(LOG_WARNING, "Unregistering Serval channel driver\n");
 	
-	pthread_cancel(thread);
-#ifdef SIGURG
-	pthread_kill(thread, SIGURG);
-#endif
-	pthread_join(thread, NULL);
+	// registration declined or failed, only the configured instances need releasing
+	if (!channel_registered){
+		free_instances();
+		return 0;
+	}
+	channel_registered = 0;
+	
+	ast_cli_unregister_multiple(cli_vomp, ARRAY_LEN(cli_vomp));
+	
+	if (thread != AST_PTHREADT_NULL){
+		if (write(monitor_wake[1], "", 1)!=1)
+			ast_log(LOG_ERROR, "Unable to wake monitor thread: %s\n", strerror(errno));
+		pthread_join(thread, NULL);
+		thread = AST_PTHREADT_NULL;
+	}
+	if (monitor_wake[0] >= 0){
+		close(monitor_wake[0]);
+		close(monitor_wake[1]);
+		monitor_wake[0] = monitor_wake[1] = -1;
+	}
+	
+	ao2_callback(channels, OBJ_NODATA | OBJ_MULTIPLE, cancel_timeout_cb, NULL);
+	vomp_peers_destroy();
+	vomp_timer_stop();
 	
 	ast_channel_unregister(&vomp_tech);
-	ao2_cleanup(vomp_tech.capabilities);
 	vomp_tech.capabilities = NULL;
+	codec_caps_destroy();
 	ao2_ref(channels, -1);
 	channels = NULL;
+	session_pool_destroy();
+	free_instances();
 	ast_log(LOG_WARNING, "Done\n");
 	return 0;
 }
@@ -0,0 +1,312 @@
+/*
+* Asterisk -- An open source telephony toolkit.
+*
+* Copyright (C) 2012 Daniel O'Connor <daniel@servalproject.org>
+*
+* See http://www.asterisk.org for more information about
+* the Asterisk project. Please do not directly contact
+* any of the maintainers of this project for assistance;
+* the project provides a web site, mailing lists and IRC
+* channels for your use.
+*
+* This program is free software, distributed under the terms of
+* the GNU General Public License Version 2. See the LICENSE file
+* at the top of the source tree.
+*/
+
+// FastAGI service for DNA lookups.
+// Answers AGI(agi://host/servaldna,<number>) from this or any other asterisk
+// using the shared lookup engine, setting the same SDNAAGI_STATUS and
+// SDNAAGI_DEST variables as servaldnaagi.py without starting a process per call.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "asterisk.h"
+#include "asterisk/lock.h"
+#include "asterisk/logger.h"
+#include "asterisk/netsock2.h"
+#include "asterisk/strings.h"
+#include "asterisk/utils.h"
+
+#include "app.h"
+
+#define AGI_PORT 4573
+// connections beyond this are closed straight away, asterisk will report AGISTATUS=FAILURE
+#define AGI_MAX_SESSIONS 32
+// how long to wait for asterisk to send the next line
+#define AGI_READ_TIMEOUT 5000
+
+struct agi_session {
+	int fd;
+	char buf[1024];
+	int len;
+};
+
+AST_MUTEX_DEFINE_STATIC(agi_lock);
+// signalled when the last session finishes
+static ast_cond_t agi_cond;
+static int agi_sessions;
+
+static int agi_fd = -1;
+static int agi_running;
+static int agi_wake[2]={-1,-1};
+static pthread_t agi_thread = AST_PTHREADT_NULL;
+
+// read one line into line, returns its length or -1
+static int agi_readline(struct agi_session *session, char *line, int size){
+	struct pollfd fd = {.fd = session->fd, .events = POLLIN};
+
+	while (1){
+		char *eol = memchr(session->buf, '\n', session->len);
+		if (eol){
+			int len = eol - session->buf;
+			int used = len + 1;
+			if (len > 0 && session->buf[len-1] == '\r')
+				len--;
+			if (len >= size)
+				len = size - 1;
+			memcpy(line, session->buf, len);
+			line[len] = 0;
+			session->len -= used;
+			memmove(session->buf, session->buf + used, session->len);
+			return len;
+		}
+		if (session->len >= sizeof(session->buf) - 1){
+			ast_log(LOG_WARNING, "FastAGI line too long\n");
+			return -1;
+		}
+		if (poll(&fd, 1, AGI_READ_TIMEOUT) <= 0)
+			return -1;
+		int ret = read(session->fd, session->buf + session->len, sizeof(session->buf) - 1 - session->len);
+		if (ret <= 0)
+			return -1;
+		session->len += ret;
+	}
+}
+
+// value is quoted and escaped, anything that can't be sent safely fails the command
+static int agi_command(struct agi_session *session, const char *name, const char *value){
+	char line[256];
+	const char *p;
+	int len = snprintf(line, sizeof(line), "SET VARIABLE \"%s\" \"", name);
+	for (p = value; *p; p++){
+		if ((unsigned char)*p < ' ' || *p == 0x7f){
+			ast_log(LOG_WARNING, "Not sending %s to FastAGI, it contains control characters\n", name);
+			return -1;
+		}
+		// room for an escape, this character, the closing quote and newline
+		if (len + 4 > sizeof(line)){
+			ast_log(LOG_WARNING, "Not sending %s to FastAGI, \"%s\" is too long\n", name, value);
+			return -1;
+		}
+		if (*p == '"' || *p == '\\')
+			line[len++] = '\\';
+		line[len++] = *p;
+	}
+	line[len++] = '"';
+	line[len++] = '\n';
+	if (write(session->fd, line, len) != len)
+		return -1;
+	// wait for "200 result=1"
+	if (agi_readline(session, line, sizeof(line)) < 0)
+		return -1;
+	if (strncmp(line, "200", 3)){
+		ast_log(LOG_WARNING, "FastAGI command failed: %s\n", line);
+		return -1;
+	}
+	return 0;
+}
+
+static void *agi_session_run(void *data){
+	struct agi_session *session = data;
+	char line[256], did[64] = "", exten[64] = "";
+	char dest[256];
+	const char *status;
+
+	// the channel environment ends with a blank line
+	while (1){
+		int len = agi_readline(session, line, sizeof(line));
+		if (len < 0)
+			goto done;
+		if (len == 0)
+			break;
+		if (!strncmp(line, "agi_arg_1: ", 11))
+			ast_copy_string(did, line + 11, sizeof(did));
+		else if (!strncmp(line, "agi_extension: ", 15))
+			ast_copy_string(exten, line + 15, sizeof(exten));
+	}
+	// AGI(agi://host/servaldna) looks up the extension being dialled
+	if (ast_strlen_zero(did))
+		ast_copy_string(did, exten, sizeof(did));
+
+	switch (dna_lookup(did, dest, sizeof(dest))){
+		case 1:
+			status = "RESOLVED";
+			break;
+		case 0:
+			status = "UNRESOLVED";
+			break;
+		default:
+			status = "FAILURE";
+	}
+	ast_debug(1, "FastAGI lookup for %s %s\n", did, status);
+
+	// never report RESOLVED without a destination to dial
+	if (!strcmp(status, "RESOLVED") && agi_command(session, "SDNAAGI_DEST", dest))
+		status = "FAILURE";
+	agi_command(session, "SDNAAGI_STATUS", status);
+
+done:
+	close(session->fd);
+	ast_free(session);
+	ast_mutex_lock(&agi_lock);
+	if (--agi_sessions == 0)
+		ast_cond_signal(&agi_cond);
+	ast_mutex_unlock(&agi_lock);
+	return NULL;
+}
+
+static void agi_accept(void){
+	struct ast_sockaddr addr;
+	struct agi_session *session;
+	pthread_t thread;
+
+	int fd = ast_accept(agi_fd, &addr);
+	if (fd < 0){
+		if (errno != EAGAIN && errno != EINTR)
+			ast_log(LOG_WARNING, "FastAGI accept failed: %s\n", strerror(errno));
+		return;
+	}
+	// the listening socket is non-blocking, which a connection may inherit
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	ast_mutex_lock(&agi_lock);
+	if (agi_sessions >= AGI_MAX_SESSIONS){
+		ast_mutex_unlock(&agi_lock);
+		ast_log(LOG_WARNING, "Refusing FastAGI connection from %s, %d lookups in progress\n",
+			ast_sockaddr_stringify(&addr), agi_sessions);
+		close(fd);
+		return;
+	}
+	agi_sessions++;
+	ast_mutex_unlock(&agi_lock);
+
+	session = ast_calloc(1, sizeof(struct agi_session));
+	if (session){
+		session->fd = fd;
+		if (!ast_pthread_create_detached_background(&thread, NULL, agi_session_run, session))
+			return;
+		ast_log(LOG_WARNING, "Unable to start FastAGI session\n");
+		ast_free(session);
+	}
+	close(fd);
+	ast_mutex_lock(&agi_lock);
+	agi_sessions--;
+	ast_mutex_unlock(&agi_lock);
+}
+
+static void *agi_run(void *ignored){
+	struct pollfd fds[2];
+	char buf[16];
+
+	fds[0].fd = agi_wake[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = agi_fd;
+	fds[1].events = POLLIN;
+
+	while (agi_running){
+		if (poll(fds, 2, -1) < 0){
+			if (errno == EINTR)
+				continue;
+			ast_log(LOG_ERROR, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+		if (fds[0].revents && read(agi_wake[0], buf, sizeof(buf)) < 0)
+			ast_log(LOG_WARNING, "Unable to read wake pipe: %s\n", strerror(errno));
+		if (fds[1].revents)
+			agi_accept();
+	}
+	return NULL;
+}
+
+// listen for FastAGI connections on address, eg 127.0.0.1 or [::]:4573
+int dna_agi_start(const char *address){
+	struct ast_sockaddr addr;
+	int reuse = 1;
+
+	if (!ast_sockaddr_parse(&addr, address, 0)){
+		ast_log(LOG_WARNING, "Invalid FastAGI address %s\n", address);
+		return -1;
+	}
+	if (!ast_sockaddr_port(&addr))
+		ast_sockaddr_set_port(&addr, AGI_PORT);
+
+	agi_fd = socket(ast_sockaddr_is_ipv6(&addr) ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+	if (agi_fd < 0){
+		ast_log(LOG_ERROR, "Unable to create FastAGI socket: %s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(agi_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (ast_bind(agi_fd, &addr) || listen(agi_fd, 16)){
+		ast_log(LOG_ERROR, "Unable to listen for FastAGI on %s: %s\n", ast_sockaddr_stringify(&addr), strerror(errno));
+		dna_agi_stop();
+		return -1;
+	}
+	fcntl(agi_fd, F_SETFL, fcntl(agi_fd, F_GETFL) | O_NONBLOCK);
+
+	if (pipe(agi_wake)){
+		ast_log(LOG_ERROR, "Unable to create pipe: %s\n", strerror(errno));
+		agi_wake[0] = agi_wake[1] = -1;
+		dna_agi_stop();
+		return -1;
+	}
+	ast_cond_init(&agi_cond, NULL);
+	agi_running = 1;
+	if (ast_pthread_create_background(&agi_thread, NULL, agi_run, NULL)){
+		ast_log(LOG_ERROR, "Unable to start FastAGI thread\n");
+		agi_running = 0;
+		agi_thread = AST_PTHREADT_NULL;
+		dna_agi_stop();
+		return -1;
+	}
+	ast_log(LOG_WARNING, "Answering FastAGI lookups on %s\n", ast_sockaddr_stringify(&addr));
+	return 0;
+}
+
+// call before dna_lookup_stop(), sessions may still be waiting for a lookup
+void dna_agi_stop(void){
+	if (agi_thread != AST_PTHREADT_NULL){
+		agi_running = 0;
+		if (write(agi_wake[1], "", 1) != 1)
+			ast_log(LOG_WARNING, "Unable to wake FastAGI thread: %s\n", strerror(errno));
+		pthread_join(agi_thread, NULL);
+		agi_thread = AST_PTHREADT_NULL;
+
+		// sessions are detached, wait for them to finish with the module
+		ast_mutex_lock(&agi_lock);
+		while (agi_sessions > 0)
+			ast_cond_wait(&agi_cond, &agi_lock);
+		ast_mutex_unlock(&agi_lock);
+	}
+	if (agi_wake[0] >= 0){
+		close(agi_wake[0]);
+		close(agi_wake[1]);
+		agi_wake[0] = agi_wake[1] = -1;
+		ast_cond_destroy(&agi_cond);
+	}
+	if (agi_fd >= 0){
+		close(agi_fd);
+		agi_fd = -1;
+	}
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 8
+ * End:
+ */
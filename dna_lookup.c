@@ -0,0 +1,710 @@
+/*
+* Asterisk -- An open source telephony toolkit.
+*
+* Copyright (C) 2012 Daniel O'Connor <daniel@servalproject.org>
+*
+* See http://www.asterisk.org for more information about
+* the Asterisk project. Please do not directly contact
+* any of the maintainers of this project for assistance;
+* the project provides a web site, mailing lists and IRC
+* channels for your use.
+*
+* This program is free software, distributed under the terms of
+* the GNU General Public License Version 2. See the LICENSE file
+* at the top of the source tree.
+*/
+
+// DNA lookups over MDP, with a cache of recent results.
+// One thread owns the MDP socket and broadcasts each lookup to the DNA
+// lookup port, resending with back off until the first reply arrives or the
+// lookup times out, so any number of lookups can be in flight at once.
+// Lookups can also be started speculatively while a number is still being
+// dialled, once no longer number could match or the caller pauses, so the
+// destination is often known before dialling is complete.
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "asterisk.h"
+#include "asterisk/lock.h"
+#include "asterisk/logger.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/pbx.h"
+#include "asterisk/cli.h"
+#include "asterisk/strings.h"
+#include "asterisk/utils.h"
+
+#include "app.h"
+#include "constants.h"
+#include "mdp_client.h"
+
+#define DNA_BUCKETS 61
+#define DNA_CACHE_MAX 256
+// first resend interval, grows by half each time
+#define DNA_RETRY_MS 125
+// numbers that nobody answered for may appear on the mesh at any time
+#define DNA_NEGATIVE_MS 10000
+// how often to try binding the MDP socket while servald isn't running
+#define DNA_BIND_RETRY_MS 5000
+// callers whose dialling can be watched at once
+#define DNA_PREFETCH_MAX 32
+// a prefix that a longer number could still match is looked up after the caller pauses this long
+#define DNA_PREFETCH_PAUSE_MS 1500
+
+int dna_lookup_timeout = 3000;
+int dna_cache_timeout = 60000;
+int dna_prefetch_min_digits = 3;
+
+#define DNA_PENDING 0
+#define DNA_RESOLVED 1
+#define DNA_UNRESOLVED 2
+
+struct dna_entry {
+	char did[64]; // the key for the cache
+	char dest[256]; // dial string, eg VOMP/<sid> or SIP/<uri>
+	int state;
+	int speculative; // started before the number was complete
+	long long expires; // when a pending lookup gives up, or a result is forgotten
+	long long next_tx; // when to send the request again
+	int interval;
+};
+
+// the digits one caller has dialled so far
+struct dna_prefetch {
+	const void *owner; // whoever is watching the digits, NULL if the slot is free
+	char context[AST_MAX_CONTEXT];
+	char digits[AST_MAX_EXTENSION];
+	long long dialled; // when the last digit arrived
+	int checked; // these digits have been dealt with
+	char started[AST_MAX_EXTENSION]; // our speculative lookup, cancelled if the caller keeps dialling
+};
+
+// protects the state of every entry, the prefetch slots and the counters
+AST_MUTEX_DEFINE_STATIC(dna_lock);
+// signalled whenever a lookup finishes
+static ast_cond_t dna_cond;
+
+static struct ao2_container *cache;
+static struct dna_prefetch prefetch_slots[DNA_PREFETCH_MAX];
+
+static char dna_path[256];
+static int dna_bound;
+static sid_t dna_sid;
+static int dna_port;
+static long long dna_next_bind;
+
+static int dna_running;
+static int dna_wake[2]={-1,-1};
+static pthread_t dna_thread = AST_PTHREADT_NULL;
+
+static int stat_lookups, stat_hits, stat_prefetched, stat_prefetch_hits;
+
+static long long dna_time_ms(void){
+	struct timeval now = ast_tvnow();
+	return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+static int dna_hash(const void *obj, const int flags){
+	const struct dna_entry *entry = obj;
+	return ast_str_hash(entry->did);
+}
+
+static int dna_compare(void *obj, void *arg, int flags){
+	struct dna_entry *entry1 = obj;
+	struct dna_entry *entry2 = arg;
+	return strcmp(entry1->did, entry2->did) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static struct dna_entry *find_entry(const char *did){
+	struct dna_entry search;
+	ast_copy_string(search.did, did, sizeof(search.did));
+	return ao2_find(cache, &search, OBJ_POINTER);
+}
+
+static void dna_poke(void){
+	if (dna_wake[1]>=0 && write(dna_wake[1], "", 1)!=1)
+		ast_log(LOG_WARNING, "Unable to wake DNA lookup thread: %s\n", strerror(errno));
+}
+
+static int expired_cb(void *obj, void *arg, int flags){
+	struct dna_entry *entry = obj;
+	long long now = *(long long *)arg;
+	return entry->state != DNA_PENDING && entry->expires <= now ? CMP_MATCH : 0;
+}
+
+// make room for another entry, called with dna_lock held
+static void cache_trim(long long now){
+	struct ao2_iterator i;
+	struct dna_entry *entry, *oldest = NULL;
+
+	ao2_callback(cache, OBJ_NODATA | OBJ_MULTIPLE | OBJ_UNLINK, expired_cb, &now);
+	if (ao2_container_count(cache) < DNA_CACHE_MAX)
+		return;
+
+	i = ao2_iterator_init(cache, 0);
+	while ((entry = ao2_iterator_next(&i))){
+		if (entry->state != DNA_PENDING && (!oldest || entry->expires < oldest->expires)){
+			if (oldest)
+				ao2_ref(oldest, -1);
+			oldest = entry;
+			continue;
+		}
+		ao2_ref(entry, -1);
+	}
+	ao2_iterator_destroy(&i);
+	if (oldest){
+		ao2_unlink(cache, oldest);
+		ao2_ref(oldest, -1);
+	}
+}
+
+// start looking up this number, unless we already know the answer or are waiting for it
+// returns the cache entry, which the caller must release
+static struct dna_entry *dna_begin(const char *did, int speculative){
+	long long now = dna_time_ms();
+	struct dna_entry *entry;
+
+	ast_mutex_lock(&dna_lock);
+	entry = find_entry(did);
+	if (entry && (entry->state == DNA_PENDING || entry->expires > now)){
+		// someone wants the answer now, so the prefetch can no longer be cancelled
+		if (entry->speculative && !speculative){
+			stat_prefetch_hits++;
+			entry->speculative = 0;
+		}
+		ast_mutex_unlock(&dna_lock);
+		return entry;
+	}
+	if (!entry){
+		if (ao2_container_count(cache) >= DNA_CACHE_MAX)
+			cache_trim(now);
+		entry = ao2_alloc(sizeof(struct dna_entry), NULL);
+		if (!entry){
+			ast_mutex_unlock(&dna_lock);
+			return NULL;
+		}
+		ast_copy_string(entry->did, did, sizeof(entry->did));
+		ao2_link(cache, entry);
+	}
+	entry->state = DNA_PENDING;
+	entry->dest[0] = 0;
+	entry->speculative = speculative;
+	entry->expires = now + dna_lookup_timeout;
+	entry->next_tx = now;
+	entry->interval = DNA_RETRY_MS;
+	if (speculative)
+		stat_prefetched++;
+	ast_mutex_unlock(&dna_lock);
+
+	dna_poke();
+	return entry;
+}
+
+// forget a speculative lookup that nobody has asked for, called with dna_lock held
+static void dna_cancel(const char *did){
+	struct dna_entry *entry = find_entry(did);
+	if (!entry)
+		return;
+	if (entry->speculative && entry->state == DNA_PENDING){
+		ast_debug(1, "Cancelling DNA prefetch for %s\n", did);
+		ao2_unlink(cache, entry);
+	}
+	ao2_ref(entry, -1);
+}
+
+// called from the lookup thread, with dna_lock held
+static void dna_finish(struct dna_entry *entry, int state, const char *dest, long long now){
+	entry->state = state;
+	if (dest)
+		ast_copy_string(entry->dest, dest, sizeof(entry->dest));
+	entry->expires = now + (state == DNA_RESOLVED ? dna_cache_timeout : DNA_NEGATIVE_MS);
+	ast_cond_broadcast(&dna_cond);
+}
+
+static int dna_bind(long long now){
+	if (dna_bound)
+		return 0;
+	if (now < dna_next_bind)
+		return -1;
+	dna_next_bind = now + DNA_BIND_RETRY_MS;
+
+	// the MDP client finds servald through the instance path on every call, like the monitor client
+	vomp_path_lock(dna_path);
+	if (overlay_mdp_client_init()){
+		vomp_path_unlock();
+		return -1;
+	}
+
+	dna_port = 32768 + (ast_random() & 32767);
+	if (overlay_mdp_getmyaddr(0, &dna_sid) || overlay_mdp_bind(&dna_sid, dna_port)){
+		overlay_mdp_client_done();
+		vomp_path_unlock();
+		ast_log(LOG_WARNING, "Unable to bind MDP socket for DNA lookups, is servald running?\n");
+		return -1;
+	}
+	vomp_path_unlock();
+	dna_bound = 1;
+	return 0;
+}
+
+static void dna_unbind(void){
+	if (!dna_bound)
+		return;
+	vomp_path_lock(dna_path);
+	overlay_mdp_client_done();
+	vomp_path_unlock();
+	dna_bound = 0;
+}
+
+static void dna_send(const char *did){
+	overlay_mdp_frame mdp;
+	memset(&mdp, 0, sizeof(mdp));
+
+	mdp.packetTypeAndFlags = MDP_TX | MDP_NOCRYPT;
+	mdp.out.dst.sid = SID_BROADCAST;
+	mdp.out.dst.port = MDP_PORT_DNALOOKUP;
+	mdp.out.src.sid = dna_sid;
+	mdp.out.src.port = dna_port;
+	mdp.out.queue = OQ_ORDINARY;
+	mdp.out.payload_length = strlen(did)+1;
+	strcpy((char *)mdp.out.payload, did);
+
+	vomp_path_lock(dna_path);
+	int ret = overlay_mdp_send(&mdp, 0, 0);
+	vomp_path_unlock();
+	if (ret){
+		ast_log(LOG_WARNING, "Failed to send DNA lookup for %s\n", did);
+		dna_unbind();
+	}
+}
+
+// a hex sid, optionally followed by /segments naming the number, eg <sid>/local/<did>
+static int valid_sid_uri(const char *p){
+	const char *sid = p;
+	while (isxdigit((unsigned char)*p))
+		p++;
+	if (p == sid || p - sid > 64)
+		return 0;
+	for (; *p; p++){
+		if (*p != '/' && !isalnum((unsigned char)*p))
+			return 0;
+	}
+	return 1;
+}
+
+// nothing that could split an AGI line, or add channels or options to Dial()
+static int valid_sip_uri(const char *p){
+	if (!*p)
+		return 0;
+	for (; *p; p++){
+		if (!isalnum((unsigned char)*p) && !strchr("-._~@:;=+%/*?!#", *p))
+			return 0;
+	}
+	return 1;
+}
+
+// convert the URI from a DNA reply into an asterisk dial string
+// replies come from any node on the mesh, so anything unexpected is refused rather than dialled
+static int uri_to_dest(const char *uri, char *dest, int len){
+	int n;
+	if (!strncasecmp(uri, "sid://", 6) && valid_sid_uri(uri+6))
+		n = snprintf(dest, len, "VOMP/%s", uri+6);
+	else if (!strncasecmp(uri, "sip://", 6) && valid_sip_uri(uri+6))
+		n = snprintf(dest, len, "SIP/%s", uri+6);
+	else{
+		ast_log(LOG_WARNING, "Ignoring DNA reply with unusable URI \"%s\"\n", uri);
+		return -1;
+	}
+	if (n >= len){
+		ast_log(LOG_WARNING, "Ignoring DNA reply with oversized URI \"%s\"\n", uri);
+		return -1;
+	}
+	return 0;
+}
+
+// replies look like sid|uri|did|name|
+static void dna_receive(long long now){
+	overlay_mdp_frame rx;
+	int ttl;
+	char reply[sizeof(rx.out.payload)+1];
+	char *fields[4], *p;
+	char dest[256];
+	int i;
+
+	vomp_path_lock(dna_path);
+	int ret = overlay_mdp_recv(&rx, dna_port, &ttl);
+	vomp_path_unlock();
+	if (ret)
+		return;
+	if ((rx.packetTypeAndFlags & MDP_TYPE_MASK) != MDP_TX)
+		return;
+
+	int len = rx.out.payload_length;
+	if (len > sizeof(rx.out.payload))
+		len = sizeof(rx.out.payload);
+	memcpy(reply, rx.out.payload, len);
+	reply[len]=0;
+
+	p = reply;
+	for (i=0;i<4;i++){
+		fields[i] = strsep(&p, "|");
+		if (!fields[i] || !p){
+			ast_log(LOG_WARNING, "Malformed DNA reply \"%s\"\n", reply);
+			return;
+		}
+	}
+	if (uri_to_dest(fields[1], dest, sizeof(dest)))
+		return;
+
+	ast_mutex_lock(&dna_lock);
+	struct dna_entry *entry = find_entry(fields[2]);
+	if (entry){
+		// first answer wins
+		if (entry->state == DNA_PENDING){
+			ast_debug(1, "DNA lookup for %s resolved to %s\n", entry->did, dest);
+			dna_finish(entry, DNA_RESOLVED, dest, now);
+		}
+		ao2_ref(entry, -1);
+	}
+	ast_mutex_unlock(&dna_lock);
+}
+
+// resend or expire pending lookups, returns the number of milliseconds until there's more to do, or -1
+static int dna_service(long long now){
+	struct ao2_iterator i;
+	struct dna_entry *entry;
+	char send_dids[DNA_CACHE_MAX][64];
+	int send_count=0, n;
+	long long next = -1;
+
+	ast_mutex_lock(&dna_lock);
+	i = ao2_iterator_init(cache, 0);
+	while ((entry = ao2_iterator_next(&i))){
+		if (entry->state == DNA_PENDING){
+			if (entry->expires <= now){
+				ast_debug(1, "DNA lookup for %s found nothing\n", entry->did);
+				dna_finish(entry, DNA_UNRESOLVED, NULL, now);
+			}else{
+				if (entry->next_tx <= now && dna_bound && send_count < DNA_CACHE_MAX){
+					ast_copy_string(send_dids[send_count++], entry->did, sizeof(send_dids[0]));
+					entry->next_tx = now + entry->interval;
+					entry->interval += entry->interval>>1;
+				}
+				// without a socket there is nothing to resend, just wait for the lookup to expire
+				long long when = dna_bound && entry->next_tx < entry->expires ? entry->next_tx : entry->expires;
+				if (next<0 || when < next)
+					next = when;
+			}
+		}
+		ao2_ref(entry, -1);
+	}
+	ao2_iterator_destroy(&i);
+	ast_mutex_unlock(&dna_lock);
+
+	for (n=0;n<send_count;n++)
+		dna_send(send_dids[n]);
+
+	if (next<0)
+		return -1;
+	return next > now ? next - now : 0;
+}
+
+// start lookups for dialled numbers that are complete in their context,
+// or that the caller has stopped dialling for a while
+// returns the number of milliseconds until a pause could end, or -1
+static int dna_run_prefetch(long long now){
+	struct dna_prefetch pending[DNA_PREFETCH_MAX];
+	int count=0, n;
+	long long next = -1;
+
+	ast_mutex_lock(&dna_lock);
+	for (n=0;n<DNA_PREFETCH_MAX;n++){
+		if (prefetch_slots[n].owner && !prefetch_slots[n].checked)
+			pending[count++] = prefetch_slots[n];
+	}
+	ast_mutex_unlock(&dna_lock);
+
+	for (n=0;n<count;n++){
+		struct dna_prefetch *p = &pending[n];
+		int done = 1;
+
+		if (!ast_exists_extension(NULL, p->context, p->digits, 1, NULL)){
+			// not a number this context will dial, wait for the next digit
+			p->started[0] = 0;
+		}else if (ast_matchmore_extension(NULL, p->context, p->digits, 1, NULL)
+				&& now - p->dialled < DNA_PREFETCH_PAUSE_MS){
+			// a longer number could still match, give the caller a chance to keep dialling
+			long long when = p->dialled + DNA_PREFETCH_PAUSE_MS;
+			if (next<0 || when < next)
+				next = when;
+			done = 0;
+		}else{
+			ast_debug(1, "Prefetching DNA lookup for %s@%s\n", p->digits, p->context);
+			struct dna_entry *entry = dna_begin(p->digits, 1);
+			if (entry)
+				ao2_ref(entry, -1);
+			ast_copy_string(p->started, p->digits, sizeof(p->started));
+		}
+		if (!done)
+			continue;
+
+		ast_mutex_lock(&dna_lock);
+		struct dna_prefetch *slot = NULL;
+		int i;
+		for (i=0;i<DNA_PREFETCH_MAX;i++){
+			if (prefetch_slots[i].owner == p->owner){
+				slot = &prefetch_slots[i];
+				break;
+			}
+		}
+		if (slot && !strcmp(slot->digits, p->digits)){
+			slot->checked = 1;
+			if (p->started[0])
+				ast_copy_string(slot->started, p->started, sizeof(slot->started));
+		}else if (p->started[0]){
+			// the caller dialled another digit or hung up while we were looking
+			dna_cancel(p->started);
+		}
+		ast_mutex_unlock(&dna_lock);
+	}
+
+	if (next<0)
+		return -1;
+	return next > now ? next - now : 0;
+}
+
+static void *dna_run(void *ignored){
+	struct pollfd fds[2];
+	char buf[16];
+
+	while (dna_running){
+		long long now = dna_time_ms();
+		int prefetch = dna_run_prefetch(now);
+		int unbound = dna_bind(now);
+		int timeout = dna_service(now);
+		int nfds = 1;
+
+		if (prefetch>=0 && (timeout<0 || prefetch < timeout))
+			timeout = prefetch;
+
+		if (unbound && (timeout<0 || timeout > DNA_BIND_RETRY_MS))
+			timeout = DNA_BIND_RETRY_MS;
+
+		fds[0].fd = dna_wake[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		if (dna_bound){
+			fds[1].fd = mdp_client_socket;
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+			nfds++;
+		}
+
+		if (poll(fds, nfds, timeout)<0){
+			if (errno==EINTR)
+				continue;
+			ast_log(LOG_ERROR, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		if (fds[0].revents && read(dna_wake[0], buf, sizeof(buf))<0)
+			ast_log(LOG_WARNING, "Unable to read wake pipe: %s\n", strerror(errno));
+		if (nfds>1 && fds[1].revents)
+			dna_receive(dna_time_ms());
+	}
+	dna_unbind();
+	return NULL;
+}
+
+// look up a number, waiting for the answer unless it's already in the cache
+// returns 1 and fills in dest if it resolved, 0 if nothing answered, or -1 on failure
+int dna_lookup(const char *did, char *dest, int len){
+	struct dna_entry *entry;
+	int ret;
+
+	if (!dna_running || ast_strlen_zero(did))
+		return -1;
+
+	entry = dna_begin(did, 0);
+	if (!entry)
+		return -1;
+
+	ast_mutex_lock(&dna_lock);
+	stat_lookups++;
+	if (entry->state != DNA_PENDING)
+		stat_hits++;
+
+	// the lookup thread finishes every pending entry when it times out, this is just a backstop
+	struct timeval deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(dna_lookup_timeout + 1000, 1000));
+	struct timespec ts = {
+		.tv_sec = deadline.tv_sec,
+		.tv_nsec = deadline.tv_usec * 1000,
+	};
+	while (entry->state == DNA_PENDING && dna_running){
+		if (ast_cond_timedwait(&dna_cond, &dna_lock, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	switch (entry->state){
+		case DNA_RESOLVED:
+			ast_copy_string(dest, entry->dest, len);
+			ret = 1;
+			break;
+		case DNA_UNRESOLVED:
+			ret = 0;
+			break;
+		default:
+			ret = -1;
+	}
+	ast_mutex_unlock(&dna_lock);
+	ao2_ref(entry, -1);
+	return ret;
+}
+
+// find the slot watching this owner's digits, or a free one, called with dna_lock held
+static struct dna_prefetch *prefetch_slot(const void *owner, int create){
+	struct dna_prefetch *free_slot = NULL;
+	int n;
+	for (n=0;n<DNA_PREFETCH_MAX;n++){
+		if (prefetch_slots[n].owner == owner)
+			return &prefetch_slots[n];
+		if (!free_slot && !prefetch_slots[n].owner)
+			free_slot = &prefetch_slots[n];
+	}
+	if (!create || !free_slot)
+		return NULL;
+	memset(free_slot, 0, sizeof(*free_slot));
+	free_slot->owner = owner;
+	return free_slot;
+}
+
+// owner has dialled digits so far in this context, look them up once they look like a complete number
+// a longer number replaces any lookup started for a shorter one
+// called from a framehook, so this must not block
+void dna_prefetch(const void *owner, const char *context, const char *digits){
+	struct dna_prefetch *slot;
+	if (!dna_running || strlen(digits) < dna_prefetch_min_digits)
+		return;
+
+	ast_mutex_lock(&dna_lock);
+	slot = prefetch_slot(owner, 1);
+	if (!slot){
+		ast_mutex_unlock(&dna_lock);
+		return;
+	}
+	if (slot->started[0]){
+		dna_cancel(slot->started);
+		slot->started[0] = 0;
+	}
+	ast_copy_string(slot->context, context, sizeof(slot->context));
+	ast_copy_string(slot->digits, digits, sizeof(slot->digits));
+	slot->dialled = dna_time_ms();
+	slot->checked = 0;
+	ast_mutex_unlock(&dna_lock);
+	dna_poke();
+}
+
+// owner has stopped watching digits, any lookup it started stays in the cache
+void dna_prefetch_done(const void *owner){
+	struct dna_prefetch *slot;
+	ast_mutex_lock(&dna_lock);
+	slot = prefetch_slot(owner, 0);
+	if (slot)
+		slot->owner = NULL;
+	ast_mutex_unlock(&dna_lock);
+}
+
+static char *dna_show_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a){
+	struct ao2_iterator i;
+	struct dna_entry *entry;
+	long long now = dna_time_ms();
+	static const char *states[] = {"Pending", "Resolved", "Unresolved"};
+
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "servaldna show cache";
+			e->usage =
+			"Usage: servaldna show cache\n"
+			"       List recent Serval DNA lookups\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	ast_cli(a->fd, "%-20s %-10s %7s  %s\n", "Number", "State", "Expires", "Destination");
+	ast_mutex_lock(&dna_lock);
+	i = ao2_iterator_init(cache, 0);
+	while ((entry = ao2_iterator_next(&i))){
+		ast_cli(a->fd, "%-20s %-10s %7lld  %s\n", entry->did, states[entry->state],
+			entry->expires > now ? (entry->expires - now) / 1000 : 0, entry->dest);
+		ao2_ref(entry, -1);
+	}
+	ao2_iterator_destroy(&i);
+	ast_cli(a->fd, "%d lookups, %d answered from the cache, %d prefetched, %d used after prefetching\n",
+		stat_lookups, stat_hits, stat_prefetched, stat_prefetch_hits);
+	ast_mutex_unlock(&dna_lock);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_dna[] = {
+	AST_CLI_DEFINE(dna_show_cache, "List recent Serval DNA lookups"),
+};
+
+int dna_lookup_start(const char *instancepath){
+	ast_copy_string(dna_path, instancepath, sizeof(dna_path));
+	cache = ao2_container_alloc(DNA_BUCKETS, dna_hash, dna_compare);
+	if (!cache)
+		return -1;
+	if (pipe(dna_wake)){
+		ast_log(LOG_ERROR, "Unable to create pipe: %s\n", strerror(errno));
+		dna_wake[0] = dna_wake[1] = -1;
+		ao2_ref(cache, -1);
+		cache = NULL;
+		return -1;
+	}
+	ast_cond_init(&dna_cond, NULL);
+	dna_running = 1;
+	if (ast_pthread_create_background(&dna_thread, NULL, dna_run, NULL)){
+		ast_log(LOG_ERROR, "Unable to start DNA lookup thread\n");
+		dna_running = 0;
+		dna_thread = AST_PTHREADT_NULL;
+		dna_lookup_stop();
+		return -1;
+	}
+	ast_cli_register_multiple(cli_dna, ARRAY_LEN(cli_dna));
+	return 0;
+}
+
+void dna_lookup_stop(void){
+	if (dna_thread != AST_PTHREADT_NULL){
+		ast_cli_unregister_multiple(cli_dna, ARRAY_LEN(cli_dna));
+		ast_mutex_lock(&dna_lock);
+		dna_running = 0;
+		// let anyone waiting for a lookup give up
+		ast_cond_broadcast(&dna_cond);
+		ast_mutex_unlock(&dna_lock);
+		dna_poke();
+		pthread_join(dna_thread, NULL);
+		dna_thread = AST_PTHREADT_NULL;
+	}
+	if (dna_wake[0]>=0){
+		close(dna_wake[0]);
+		close(dna_wake[1]);
+		dna_wake[0] = dna_wake[1] = -1;
+		ast_cond_destroy(&dna_cond);
+	}
+	if (cache){
+		ao2_ref(cache, -1);
+		cache = NULL;
+	}
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 8
+ * End:
+ */
@@ -49,8 +49,10 @@
 #    same => n,Hangup()
 #
 # This is slow because we are a Python script and we have to fork
-# servald.  When the monitor interface grows a way to do queries then
-# we can write a proper extension.
+# servald.  The channel driver now does the same lookups itself, use the
+# SERVALDNA() dialplan function, or AGI(agi://127.0.0.1/servaldna,${EXTEN})
+# with fastagi set in servaldna.conf, which sets the same variables as this
+# script.
 #
 # Note that servald must be running as the same user as asterisk for this to work.
 #
@@ -91,8 +93,9 @@ def main():
 
     os.environ['SERVALINSTANCE_PATH'] = instancedir
     servaldproc = subprocess.Popen([binpath, 'dna', 'lookup', did, '-3000'], stdout = subprocess.PIPE)
-    servaldres = servaldproc.wait()
+    # Read all the output before reaping servald, waiting first can deadlock once the pipe fills
     (servaldout, servalderr) = servaldproc.communicate()
+    servaldres = servaldproc.returncode
     if servaldres != 0:
         debug("Servald returned %d" % (servaldres))
         sys.exit(1)
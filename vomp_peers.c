@@ -0,0 +1,370 @@
+/*
+* Asterisk -- An open source telephony toolkit.
+*
+* Copyright (C) 2012 Daniel O'Connor <daniel@servalproject.org>
+*
+* See http://www.asterisk.org for more information about
+* the Asterisk project. Please do not directly contact
+* any of the maintainers of this project for assistance;
+* the project provides a web site, mailing lists and IRC
+* channels for your use.
+*
+* This program is free software, distributed under the terms of
+* the GNU General Public License Version 2. See the LICENSE file
+* at the top of the source tree.
+*/
+
+// Reachability of mesh peers, published as the device state of VOMP/<sid>.
+// Each servald instance tells us which peers it has a route to, and calls
+// that never manage to ring the far end put the peer on hold down for a while,
+// so queues and hints can skip dead peers without waiting for Dial to time out.
+
+#include <ctype.h>
+
+#include "asterisk.h"
+#include "asterisk/lock.h"
+#include "asterisk/logger.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/devicestate.h"
+#include "asterisk/pbx.h"
+#include "asterisk/cli.h"
+#include "asterisk/app.h"
+#include "asterisk/strings.h"
+#include "asterisk/utils.h"
+
+#include "app.h"
+
+/*** DOCUMENTATION
+	<function name="VOMP_PEERSTATE" language="en_US">
+		<synopsis>
+			Get the cached reachability of a mesh peer
+		</synopsis>
+		<syntax>
+			<parameter name="sid" required="true" />
+		</syntax>
+		<description>
+		<para>Returns the device state of VOMP/<replaceable>sid</replaceable>, one of
+		UNKNOWN, NOT_INUSE, INUSE or UNAVAILABLE, without waiting for a call to fail.</para>
+		</description>
+	</function>
+ ***/
+
+// consecutive calls that never ring before a peer is put on hold down
+#define PEER_FAILURE_LIMIT 2
+#define PEER_BUCKETS 127
+
+int vomp_peer_holddown = 60000;
+int vomp_max_peers;
+
+struct vomp_peer {
+	char sid[65]; // upper case hex, the key for the peers collection
+	unsigned reachable; // bit mask of the instances with a route to this peer
+	int announced; // servald has told us whether this peer is reachable
+	int calls; // sessions currently connected to this peer
+	int failures; // consecutive calls that never rang
+	long long holddown_until;
+	int state; // last device state we published
+	struct vomp_timer timer; // republish when the hold down expires
+};
+
+static struct ao2_container *peers;
+
+static long long peer_time_ms(void){
+	struct timeval now = ast_tvnow();
+	return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+// copy the sid part of a dial string, ignoring any trailing /did
+static void peer_key(char *key, const char *sid){
+	int i;
+	for (i=0;i<64 && sid[i] && sid[i]!='/';i++)
+		key[i]=toupper(sid[i]);
+	key[i]=0;
+}
+
+static int peer_hash(const void *obj, const int flags){
+	const struct vomp_peer *peer = obj;
+	return ast_str_hash(peer->sid);
+}
+
+static int peer_compare(void *obj, void *arg, int flags){
+	struct vomp_peer *peer1 = obj;
+	struct vomp_peer *peer2 = arg;
+	return strcmp(peer1->sid, peer2->sid) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static struct vomp_peer *find_peer(const char *sid){
+	struct vomp_peer search;
+	if (!peers)
+		return NULL;
+	peer_key(search.sid, sid);
+	return ao2_find(peers, &search, OBJ_POINTER);
+}
+
+static void peer_holddown_expired(struct vomp_timer *timer);
+
+// find the peer, creating it if this is the first we've heard of it
+static struct vomp_peer *get_peer(const char *sid){
+	struct vomp_peer *peer;
+	if (!peers)
+		return NULL;
+
+	ao2_lock(peers);
+	peer = find_peer(sid);
+	if (!peer && vomp_max_peers > 0 && ao2_container_count(peers) >= vomp_max_peers){
+		// the peer will be reported as unknown, rather than growing without bound
+		ast_debug(1, "Not tracking %s, already tracking %d peers\n", sid, vomp_max_peers);
+	}else if (!peer){
+		peer = ao2_alloc(sizeof(struct vomp_peer), NULL);
+		if (peer){
+			peer_key(peer->sid, sid);
+			peer->state = AST_DEVICE_UNKNOWN;
+			peer->timer.callback = peer_holddown_expired;
+			peer->timer.context = peer;
+			ao2_link(peers, peer);
+		}
+	}
+	ao2_unlock(peers);
+	return peer;
+}
+
+// called with the peer locked
+static int peer_state(struct vomp_peer *peer){
+	if (peer->failures >= PEER_FAILURE_LIMIT && peer_time_ms() < peer->holddown_until)
+		return AST_DEVICE_UNAVAILABLE;
+	if (peer->announced && !peer->reachable)
+		return AST_DEVICE_UNAVAILABLE;
+	if (peer->calls > 0)
+		return AST_DEVICE_INUSE;
+	if (peer->announced)
+		return AST_DEVICE_NOT_INUSE;
+	return AST_DEVICE_UNKNOWN;
+}
+
+// tell asterisk if the state of this peer has changed
+static void peer_publish(struct vomp_peer *peer){
+	int state, changed;
+
+	ao2_lock(peer);
+	state = peer_state(peer);
+	changed = state != peer->state;
+	peer->state = state;
+	ao2_unlock(peer);
+
+	if (changed){
+		ast_debug(1, "VOMP/%s is now %s\n", peer->sid, ast_devstate_str(state));
+		ast_devstate_changed(state, AST_DEVSTATE_CACHABLE, "VOMP/%s", peer->sid);
+	}
+}
+
+// an armed hold down timer holds a reference to the peer
+static void peer_holddown_expired(struct vomp_timer *timer){
+	struct vomp_peer *peer = timer->context;
+	ao2_lock(peer);
+	// give the peer a fresh start, unless another failure has extended the hold down
+	if (vomp_timer_current(timer))
+		peer->failures = 0;
+	ao2_unlock(peer);
+	peer_publish(peer);
+	ao2_ref(peer, -1);
+}
+
+// NEWPEER / OLDPEER from one of our servald instances
+void vomp_peer_reachable(const char *sid, int instance, int reachable){
+	struct vomp_peer *peer = get_peer(sid);
+	if (!peer)
+		return;
+
+	ao2_lock(peer);
+	peer->announced = 1;
+	if (reachable){
+		peer->reachable |= 1u<<instance;
+		// a fresh route is worth trying again
+		peer->failures = 0;
+	}else
+		peer->reachable &= ~(1u<<instance);
+	ao2_unlock(peer);
+
+	peer_publish(peer);
+	ao2_ref(peer, -1);
+}
+
+static int peer_instance_lost_cb(void *obj, void *arg, int flags){
+	struct vomp_peer *peer = obj;
+	unsigned mask = *(unsigned *)arg;
+
+	ao2_lock(peer);
+	peer->reachable &= ~mask;
+	ao2_unlock(peer);
+
+	peer_publish(peer);
+	return 0;
+}
+
+// we've lost the monitor connection, servald will tell us about its peers again when we reconnect
+void vomp_peer_instance_lost(int instance){
+	unsigned mask = 1u<<instance;
+	if (!peers)
+		return;
+	ao2_callback(peers, OBJ_NODATA | OBJ_MULTIPLE, peer_instance_lost_cb, &mask);
+}
+
+// a call to this peer has rung (reached) or timed out without ringing
+void vomp_peer_call_result(const char *sid, int reached){
+	struct vomp_peer *peer = get_peer(sid);
+	if (!peer)
+		return;
+
+	ao2_lock(peer);
+	if (reached){
+		peer->failures = 0;
+	}else if (++peer->failures >= PEER_FAILURE_LIMIT && vomp_peer_holddown > 0){
+		peer->holddown_until = peer_time_ms() + vomp_peer_holddown;
+		if (vomp_timer_set(&peer->timer, vomp_peer_holddown))
+			ao2_ref(peer, +1);
+	}
+	ao2_unlock(peer);
+
+	peer_publish(peer);
+	ao2_ref(peer, -1);
+}
+
+// a session to this peer has started (+1) or finished (-1)
+void vomp_peer_call_count(const char *sid, int delta){
+	// don't start tracking a peer just because a call we weren't counting has finished
+	struct vomp_peer *peer = delta > 0 ? get_peer(sid) : find_peer(sid);
+	if (!peer)
+		return;
+
+	ao2_lock(peer);
+	peer->calls += delta;
+	ao2_unlock(peer);
+
+	peer_publish(peer);
+	ao2_ref(peer, -1);
+}
+
+// the cached device state of this peer
+int vomp_peer_state(const char *sid){
+	int state = AST_DEVICE_UNKNOWN;
+	struct vomp_peer *peer = find_peer(sid);
+	if (peer){
+		ao2_lock(peer);
+		state = peer_state(peer);
+		ao2_unlock(peer);
+		ao2_ref(peer, -1);
+	}
+	return state;
+}
+
+// sessions currently connected to this peer
+int vomp_peer_calls(const char *sid){
+	int calls = 0;
+	struct vomp_peer *peer = find_peer(sid);
+	if (peer){
+		ao2_lock(peer);
+		calls = peer->calls;
+		ao2_unlock(peer);
+		ao2_ref(peer, -1);
+	}
+	return calls;
+}
+
+// returns 1 if the instance has a route to this peer, 0 if it doesn't, or -1 if we don't know
+int vomp_peer_reachable_via(const char *sid, int instance){
+	int ret = -1;
+	struct vomp_peer *peer = find_peer(sid);
+	if (peer){
+		ao2_lock(peer);
+		if (peer->announced)
+			ret = (peer->reachable & (1u<<instance)) ? 1 : 0;
+		ao2_unlock(peer);
+		ao2_ref(peer, -1);
+	}
+	return ret;
+}
+
+void vomp_peers_usage(int *count, int *size){
+	*count = peers ? ao2_container_count(peers) : 0;
+	*size = sizeof(struct vomp_peer);
+}
+
+static int peerstate_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len){
+	if (ast_strlen_zero(data)){
+		ast_log(LOG_WARNING, "VOMP_PEERSTATE requires a sid\n");
+		return -1;
+	}
+	ast_copy_string(buf, ast_devstate_str(vomp_peer_state(data)), len);
+	return 0;
+}
+
+static struct ast_custom_function peerstate_function = {
+	.name = "VOMP_PEERSTATE",
+	.read = peerstate_read,
+};
+
+static char *vomp_show_peers(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a){
+	struct ao2_iterator i;
+	struct vomp_peer *peer;
+	long long now = peer_time_ms();
+
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "vomp show peers";
+			e->usage =
+			"Usage: vomp show peers\n"
+			"       List the cached reachability of mesh peers\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	ast_cli(a->fd, "%-64s %-12s %6s %5s %8s %9s\n", "SID", "State", "Routes", "Calls", "Failures", "Holddown");
+	i = ao2_iterator_init(peers, 0);
+	while ((peer = ao2_iterator_next(&i))){
+		ao2_lock(peer);
+		ast_cli(a->fd, "%-64s %-12s %6x %5d %8d %9lld\n", peer->sid, ast_devstate_str(peer_state(peer)),
+			peer->reachable, peer->calls, peer->failures,
+			peer->holddown_until > now ? (peer->holddown_until - now) / 1000 : 0);
+		ao2_unlock(peer);
+		ao2_ref(peer, -1);
+	}
+	ao2_iterator_destroy(&i);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_peers[] = {
+	AST_CLI_DEFINE(vomp_show_peers, "List mesh peer reachability"),
+};
+
+int vomp_peers_init(void){
+	peers = ao2_container_alloc(PEER_BUCKETS, peer_hash, peer_compare);
+	if (!peers)
+		return -1;
+	ast_custom_function_register(&peerstate_function);
+	ast_cli_register_multiple(cli_peers, ARRAY_LEN(cli_peers));
+	return 0;
+}
+
+static int peer_cancel_cb(void *obj, void *arg, int flags){
+	struct vomp_peer *peer = obj;
+	if (vomp_timer_cancel(&peer->timer))
+		ao2_ref(peer, -1);
+	return 0;
+}
+
+void vomp_peers_destroy(void){
+	if (!peers)
+		return;
+	ast_cli_unregister_multiple(cli_peers, ARRAY_LEN(cli_peers));
+	ast_custom_function_unregister(&peerstate_function);
+	ao2_callback(peers, OBJ_NODATA | OBJ_MULTIPLE, peer_cancel_cb, NULL);
+	ao2_ref(peers, -1);
+	peers = NULL;
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 8
+ * End:
+ */
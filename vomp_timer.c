@@ -0,0 +1,199 @@
+/*
+* Asterisk -- An open source telephony toolkit.
+*
+* Copyright (C) 2012 Daniel O'Connor <daniel@servalproject.org>
+*
+* See http://www.asterisk.org for more information about
+* the Asterisk project. Please do not directly contact
+* any of the maintainers of this project for assistance;
+* the project provides a web site, mailing lists and IRC
+* channels for your use.
+*
+* This program is free software, distributed under the terms of
+* the GNU General Public License Version 2. See the LICENSE file
+* at the top of the source tree.
+*/
+
+// Hashed timing wheel for per session timeouts.
+// Timers are hashed into a fixed number of slots by their expiry tick, so
+// arming, cancelling and servicing a tick are all O(1) regardless of how
+// many sessions are active. Delays longer than one revolution of the wheel
+// are handled by counting down the number of remaining rounds.
+
+#include "asterisk.h"
+#include "asterisk/lock.h"
+#include "asterisk/logger.h"
+#include "asterisk/time.h"
+#include "asterisk/utils.h"
+
+#include "app.h"
+
+#define WHEEL_BITS 9
+#define WHEEL_SIZE (1<<WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE-1)
+
+AST_MUTEX_DEFINE_STATIC(wheel_lock);
+static ast_cond_t wheel_cond;
+
+static struct vomp_timer *wheel[WHEEL_SIZE];
+// timers that have expired but whose callbacks haven't been called yet
+static struct vomp_timer *wheel_expired;
+// the last tick that has been processed
+static unsigned long long wheel_tick;
+static struct timeval wheel_start;
+static int wheel_running;
+static pthread_t wheel_thread = AST_PTHREADT_NULL;
+
+static void list_push(struct vomp_timer **head, struct vomp_timer *timer){
+	timer->prev = NULL;
+	timer->next = *head;
+	if (timer->next)
+		timer->next->prev = timer;
+	*head = timer;
+}
+
+static void wheel_insert(struct vomp_timer *timer, unsigned long long ticks){
+	unsigned slot = (wheel_tick + ticks) & WHEEL_MASK;
+	timer->rounds = (ticks - 1) >> WHEEL_BITS;
+	timer->slot = slot;
+	timer->expiring = 0;
+	list_push(&wheel[slot], timer);
+	timer->armed = 1;
+}
+
+// take the timer out of its slot or the expired list
+static void wheel_remove(struct vomp_timer *timer){
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else if (timer->expiring)
+		wheel_expired = timer->next;
+	else
+		wheel[timer->slot] = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+	timer->expiring = 0;
+	timer->armed = 0;
+}
+
+// (re)arm a timer to fire once after delay_ms
+// a timer that has expired but not yet fired is moved back into the wheel instead
+// returns 1 if the timer was idle, so the caller can take a reference on the context
+int vomp_timer_set(struct vomp_timer *timer, int delay_ms){
+	int was_idle;
+	unsigned long long ticks = (delay_ms + VOMP_TIMER_TICK_MS - 1) / VOMP_TIMER_TICK_MS;
+	if (ticks < 1)
+		ticks = 1;
+
+	ast_mutex_lock(&wheel_lock);
+	was_idle = !timer->armed;
+	if (timer->armed)
+		wheel_remove(timer);
+	timer->generation++;
+	wheel_insert(timer, ticks);
+	ast_mutex_unlock(&wheel_lock);
+	return was_idle;
+}
+
+// returns 1 if the timer was armed, so the caller can release its reference on the context
+int vomp_timer_cancel(struct vomp_timer *timer){
+	int was_armed;
+	ast_mutex_lock(&wheel_lock);
+	was_armed = timer->armed;
+	if (was_armed)
+		wheel_remove(timer);
+	timer->generation++;
+	ast_mutex_unlock(&wheel_lock);
+	return was_armed;
+}
+
+// call from a callback, returns 0 if the timer has been set or cancelled since it expired
+// so the callback is stale, though it must still release the reference it was holding
+int vomp_timer_current(struct vomp_timer *timer){
+	int current;
+	ast_mutex_lock(&wheel_lock);
+	current = timer->fired == timer->generation;
+	ast_mutex_unlock(&wheel_lock);
+	return current;
+}
+
+static void *wheel_run(void *ignored){
+	ast_mutex_lock(&wheel_lock);
+	while (wheel_running){
+		unsigned long long now_tick = ast_tvdiff_ms(ast_tvnow(), wheel_start) / VOMP_TIMER_TICK_MS;
+
+		if (now_tick <= wheel_tick){
+			struct timeval next = ast_tvadd(wheel_start,
+				ast_samp2tv((wheel_tick + 1) * VOMP_TIMER_TICK_MS, 1000));
+			struct timespec ts = {
+				.tv_sec = next.tv_sec,
+				.tv_nsec = next.tv_usec * 1000,
+			};
+			ast_cond_timedwait(&wheel_cond, &wheel_lock, &ts);
+			continue;
+		}
+
+		// catch up on every tick we've missed, moving expired timers to their own list
+		// they stay armed until their callback is due, so setting or cancelling one meanwhile
+		// just takes it back off the list
+		while (wheel_tick < now_tick){
+			struct vomp_timer *timer, *next;
+			wheel_tick++;
+			for (timer = wheel[wheel_tick & WHEEL_MASK]; timer; timer = next){
+				next = timer->next;
+				if (timer->rounds > 0){
+					timer->rounds--;
+					continue;
+				}
+				wheel_remove(timer);
+				list_push(&wheel_expired, timer);
+				timer->expiring = 1;
+				timer->armed = 1;
+			}
+		}
+
+		// fire callbacks without holding the wheel lock, they may re-arm or cancel any timer
+		while (wheel_expired){
+			struct vomp_timer *timer = wheel_expired;
+			wheel_remove(timer);
+			timer->fired = timer->generation;
+			ast_mutex_unlock(&wheel_lock);
+			timer->callback(timer);
+			ast_mutex_lock(&wheel_lock);
+		}
+	}
+	ast_mutex_unlock(&wheel_lock);
+	return NULL;
+}
+
+int vomp_timer_start(void){
+	ast_cond_init(&wheel_cond, NULL);
+	wheel_start = ast_tvnow();
+	wheel_tick = 0;
+	wheel_running = 1;
+	if (ast_pthread_create_background(&wheel_thread, NULL, wheel_run, NULL)){
+		ast_log(LOG_ERROR, "Unable to start timer thread\n");
+		wheel_running = 0;
+		wheel_thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void vomp_timer_stop(void){
+	if (wheel_thread == AST_PTHREADT_NULL)
+		return;
+	ast_mutex_lock(&wheel_lock);
+	wheel_running = 0;
+	ast_cond_signal(&wheel_cond);
+	ast_mutex_unlock(&wheel_lock);
+	pthread_join(wheel_thread, NULL);
+	wheel_thread = AST_PTHREADT_NULL;
+	ast_cond_destroy(&wheel_cond);
+}
+
+/*
+ * Local variables:
+ * c-basic-offset: 8
+ * End:
+ */